@@ -0,0 +1,190 @@
+/******************************************************************************
+* File Name: project.h (host simulator)
+*
+* Description: Stands in for the PSoC Creator generated project.h so that
+* Source/main.c builds unchanged on a Linux host. Only the component APIs,
+* register macros and CMSIS intrinsics that main.c uses are declared here;
+* their behaviour lives in sim_hal.c and runs on virtual time.
+*
+*******************************************************************************/
+
+#ifndef SIM_PROJECT_H
+#define SIM_PROJECT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// cytypes.h
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef int8_t int8;
+typedef int16_t int16;
+typedef int32_t int32;
+typedef volatile uint8 reg8;
+typedef volatile uint16 reg16;
+typedef volatile uint32 reg32;
+typedef uint8 cystatus_t;
+typedef void (*cyisraddress)(void);
+
+#define CY_ISR(function) void function(void)
+#define CY_ISR_PROTO(function) void function(void)
+
+#define LO16(x) ((uint16) ((x) & 0xFFFFu))
+#define HI16(x) ((uint16) ((uint32) (x) >> 16u))
+
+// Register addresses are host pointers here, so the accessors go through uintptr_t
+#define CY_GET_REG8(addr) (*(reg8 *) (uintptr_t) (addr))
+#define CY_SET_REG8(addr, value) (*(reg8 *) (uintptr_t) (addr) = (uint8) (value))
+#define CY_GET_REG32(addr) (*(reg32 *) (uintptr_t) (addr))
+#define CY_SET_REG32(addr, value) (*(reg32 *) (uintptr_t) (addr) = (uint32) (value))
+
+#define BCLK__BUS_CLK__HZ 24000000u
+
+// CyLib.h
+#define CyGlobalIntEnable __enable_irq()
+#define CyGlobalIntDisable __disable_irq()
+uint8 CyEnterCriticalSection(void);
+void CyExitCriticalSection(uint8 savedIntrStatus);
+void CyDelay(uint32 milliseconds);
+void CyDelayUs(uint16 microseconds);
+
+// CMSIS core
+typedef struct {
+    volatile uint32 CTRL;
+    volatile uint32 CYCCNT;
+} DWT_Type;
+
+typedef struct {
+    volatile uint32 DEMCR;
+} CoreDebug_Type;
+
+typedef struct {
+    volatile uint32 SCR;
+} SCB_Type;
+
+extern DWT_Type sim_dwt;
+extern CoreDebug_Type sim_core_debug;
+extern SCB_Type sim_scb;
+#define DWT (&sim_dwt)
+#define CoreDebug (&sim_core_debug)
+#define SCB (&sim_scb)
+#define CoreDebug_DEMCR_TRCENA_Msk (1UL << 24)
+#define DWT_CTRL_CYCCNTENA_Msk 1UL
+#define SCB_SCR_SLEEPONEXIT_Msk (1UL << 1)
+
+void __WFI(void);
+void __disable_irq(void);
+void __enable_irq(void);
+void __DMB(void);
+uint8 __CLZ(uint32 value);
+
+// Interrupt components
+#define SIM_DECLARE_ISR(name) \
+    void name##_StartEx(cyisraddress address); \
+    void name##_Stop(void); \
+    void name##_Enable(void); \
+    void name##_Disable(void); \
+    void name##_SetPending(void); \
+    void name##_ClearPending(void);
+
+SIM_DECLARE_ISR(isr_1)
+SIM_DECLARE_ISR(isr_6)
+SIM_DECLARE_ISR(isr_PIR)
+SIM_DECLARE_ISR(isr_UART)
+
+// Pins
+#define SIM_DECLARE_PIN(name) \
+    uint8 name##_Read(void); \
+    void name##_Write(uint8 value); \
+    void name##_SetDriveMode(uint8 mode); \
+    uint8 name##_ClearInterrupt(void);
+
+SIM_DECLARE_PIN(Pin_LOAD)
+SIM_DECLARE_PIN(Pin_PIR)
+SIM_DECLARE_PIN(Pin_Up)
+SIM_DECLARE_PIN(Pin_Down)
+SIM_DECLARE_PIN(Pin_Brightness)
+SIM_DECLARE_PIN(SCL_1)
+SIM_DECLARE_PIN(SDA_1)
+
+// SCL_1 and SDA_1 share port 12; its bypass register hands the pins to the I2C block
+extern volatile uint8 sim_port12_bypass;
+#define SCL_1__BYP ((uintptr_t) &sim_port12_bypass)
+#define SDA_1__BYP ((uintptr_t) &sim_port12_bypass)
+#define SCL_1__MASK 0x01u
+#define SDA_1__MASK 0x02u
+
+// SPIM_1 (12-bit words to the MAX6920 chain)
+#define SPIM_1_TX_BUFFER_SIZE 4u
+#define SPIM_1_STS_SPI_DONE 0x01u
+#define SPIM_1_STS_TX_FIFO_NOT_FULL 0x04u
+extern volatile uint16 sim_spim_txdata;
+#define SPIM_1_TXDATA_PTR (&sim_spim_txdata)
+void SPIM_1_Start(void);
+void SPIM_1_ClearTxBuffer(void);
+void SPIM_1_ClearRxBuffer(void);
+void SPIM_1_WriteTxData(uint16 txData);
+uint8 SPIM_1_ReadStatus(void);
+uint8 SPIM_1_ReadTxStatus(void);
+
+// PWM_1 (filament drive), PWM_2 (display brightness)
+void PWM_1_Start(void);
+void PWM_2_Start(void);
+void PWM_2_WriteCompare(uint8 compare);
+
+// Timer_1 (multiplex), Timer_3 (1 ms tick)
+void Timer_1_Start(void);
+void Timer_1_Stop(void);
+uint8 Timer_1_ReadStatusRegister(void);
+void Timer_3_Start(void);
+uint8 Timer_3_ReadStatusRegister(void);
+
+// I2C_1 (fixed-function master)
+#define I2C_1_MSTR_NO_ERROR 0x00u
+#define I2C_1_MSTR_BUS_BUSY 0x01u
+#define I2C_1_MSTAT_RD_CMPLT 0x01u
+#define I2C_1_MSTAT_WR_CMPLT 0x02u
+#define I2C_1_MSTAT_XFER_INP 0x04u
+#define I2C_1_MSTAT_XFER_HALT 0x08u
+#define I2C_1_MSTAT_ERR_MASK 0xF0u
+#define I2C_1_MSTAT_ERR_SHORT_XFER 0x10u
+#define I2C_1_MSTAT_ERR_ADDR_NAK 0x20u
+#define I2C_1_MSTAT_ERR_ARB_LOST 0x40u
+#define I2C_1_MSTAT_ERR_XFER 0x80u
+#define I2C_1_MODE_COMPLETE_XFER 0x00u
+#define I2C_1_MODE_REPEAT_START 0x01u
+#define I2C_1_MODE_NO_STOP 0x02u
+void I2C_1_Start(void);
+void I2C_1_Stop(void);
+uint8 I2C_1_MasterStatus(void);
+uint8 I2C_1_MasterClearStatus(void);
+uint8 I2C_1_MasterWriteBuf(uint8 slaveAddress, uint8 *wrData, uint8 cnt, uint8 mode);
+uint8 I2C_1_MasterReadBuf(uint8 slaveAddress, uint8 *rdData, uint8 cnt, uint8 mode);
+
+// UART_1 (optional serial protocol)
+#define UART_1_RX_STS_FIFO_NOTEMPTY 0x20u
+void UART_1_Start(void);
+uint8 UART_1_ReadRxStatus(void);
+uint8 UART_1_ReadRxData(void);
+void UART_1_PutArray(const uint8 string[], uint8 byteCount);
+
+// DMA_Refresh and CyDmac (optional DMA refresh; one channel and a TD chain, see sim_hal.c)
+#define CYDEV_SRAM_BASE 0x1FFF8000u
+#define CYDEV_PERIPH_BASE 0x40000000u
+#define CY_DMA_INVALID_TD 0xFFu
+#define CY_DMA_DISABLE_TD 0xFEu
+#define TD_INC_SRC_ADR 0x08u
+#define TD_INC_DST_ADR 0x04u
+#define TD_AUTO_EXEC_NEXT 0x20u
+uint8 DMA_Refresh_DmaInitialize(uint8 burstCount, uint8 requestPerBurst, uint16 upperSrcAddress, uint16 upperDestAddress);
+uint8 CyDmaTdAllocate(void);
+cystatus_t CyDmaTdSetConfiguration(uint8 tdHandle, uint16 transferCount, uint8 nextTd, uint8 configuration);
+cystatus_t CyDmaTdSetAddress(uint8 tdHandle, uint16 source, uint16 destination);
+cystatus_t CyDmaChSetInitialTd(uint8 chHandle, uint8 startTd);
+cystatus_t CyDmaChEnable(uint8 chHandle, uint8 preserveTds);
+cystatus_t CyDmaChDisable(uint8 chHandle);
+
+#include "cyapicallbacks.h"
+
+#endif /* SIM_PROJECT_H */
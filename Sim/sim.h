@@ -0,0 +1,114 @@
+/******************************************************************************
+* File Name: sim.h
+*
+* Description: Host simulator for the VFD Clock firmware. Source/main.c runs
+* unchanged on a virtual clock: the 1 ms tick, the multiplex timer, the I2C
+* block and a DS1307 model raise their interrupts at virtual times, and the
+* firmware's WFI skips straight to the next one, so hours of clock time run
+* in seconds. Scenarios drive pins and the serial port through timed actions
+* and watch the display through the latched MAX6920 outputs.
+*
+*******************************************************************************/
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+// Virtual hardware timing
+#define SIM_TICK_PERIOD_US 1000     // Timer_3
+#define SIM_MULTIPLEX_PERIOD_US 650 // Timer_1: period 649 on a 1 MHz clock
+#define SIM_I2C_BYTE_US 90          // Nine bit times at 100 kHz
+#define SIM_CYCLES_PER_US 24        // DWT->CYCCNT follows virtual time at BCLK
+
+// Interrupt sources, in dispatch order (all run at the same priority, so none nests)
+#define SIM_IRQ_MULTIPLEX 0
+#define SIM_IRQ_TICK 1
+#define SIM_IRQ_I2C 2
+#define SIM_IRQ_PIR 3
+#define SIM_IRQ_UART 4
+#define SIM_IRQ_COUNT 5
+
+// Buttons, by the pins they read
+#define SIM_BUTTON_BRIGHTNESS 0
+#define SIM_BUTTON_UP 1
+#define SIM_BUTTON_DOWN 2
+
+typedef struct {
+    uint32_t count;
+    uint64_t total_ns; // Host time spent in the handler
+    uint64_t max_ns;
+} SimIsrStats;
+
+typedef struct {
+    SimIsrStats isr[SIM_IRQ_COUNT];
+    uint32_t wakes;          // Returns to the main loop from WFI
+    uint32_t handler_wakes;  // Wakes that only ran handlers and slept again (sleep-on-exit)
+    uint32_t passes;         // Main-loop passes from a wake to the next WFI
+    uint64_t pass_total_ns;  // Host time in those passes, handlers included
+    uint64_t pass_max_ns;
+    uint32_t i2c_transfers;  // Bus transactions started, one per START
+    uint32_t i2c_bytes;      // Address bytes included
+    uint32_t i2c_naks;
+    uint32_t bus_recoveries; // SDA released by SCL clocking
+    uint32_t spi_words;
+    uint32_t latches;
+} SimStats;
+
+// DS1307 at 0x68. The time registers count in whichever mode was last written.
+typedef struct {
+    uint8_t regs[64];       // 0x00-0x07 clock and control, 0x08-0x3F NVRAM
+    uint8_t present;        // 0 = every transfer is NAKed
+    uint8_t hang_clocks;    // Non-zero: the next transfer stalls holding SDA low until this many SCL clocks
+    uint32_t sub_second_us; // Time since the seconds register last advanced
+} SimDs1307;
+
+typedef void (*SimAction)(void);
+typedef void (*SimLatchHook)(uint64_t outputs);
+
+extern SimStats sim_stats;
+extern SimDs1307 sim_ds1307;
+extern uint64_t sim_now_us;
+
+/**
+ * Sets the DS1307 time registers (24-hour mode, oscillator running).
+ */
+void SimSetRtcTime(uint8_t hours, uint8_t minutes, uint8_t seconds);
+
+/**
+ * Sets the DS1307 time registers in 12-hour mode (hours 0-23, oscillator running).
+ */
+void SimSetRtcTime12Hour(uint8_t hours, uint8_t minutes, uint8_t seconds);
+
+/**
+ * Reads the DS1307 time registers back as seconds since midnight.
+ */
+uint32_t SimRtcTimeOfDay(void);
+
+/**
+ * Runs an action at a virtual time. Actions run between interrupts, like hardware events.
+ */
+void SimAt(uint64_t time_us, SimAction action);
+
+void SimSetPir(uint8_t level);
+void SimSetButton(uint8_t button, uint8_t pressed);
+void SimUartReceive(const uint8_t *data, uint8_t length);
+const uint8_t *SimUartSent(uint32_t *length);
+
+/**
+ * Called with the 64 MAX6920 outputs (bit n = output n) on every LOAD strobe.
+ */
+void SimOnLatch(SimLatchHook hook);
+
+uint8_t SimPwmCompare(void);
+
+/**
+ * Boots the firmware and runs it until virtual time reaches end_us. The firmware cannot be
+ * restarted within one process. Returns 0, or 1 if it slept with nothing left to wake it.
+ */
+int SimRunFirmware(uint64_t end_us);
+
+void SimFail(const char *format, ...);
+int SimFailures(void);
+
+#endif /* SIM_H */
@@ -0,0 +1,870 @@
+/******************************************************************************
+* File Name: sim_hal.c
+*
+* Description: Virtual-time implementation of the component APIs declared in
+* Sim/include/project.h. Code runs in zero virtual time; only WFI and the
+* CyDelay calls move the clock. Interrupts are latched as pending when their
+* source fires and dispatched whenever PRIMASK is clear and no handler is
+* running, which matches the single priority level the firmware uses.
+*
+*******************************************************************************/
+
+#include <project.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sim.h"
+
+int firmware_main(void);
+
+SimStats sim_stats;
+SimDs1307 sim_ds1307 = {{0}, 1, 0, 0};
+uint64_t sim_now_us = 0;
+
+DWT_Type sim_dwt;
+CoreDebug_Type sim_core_debug;
+SCB_Type sim_scb;
+volatile uint8 sim_port12_bypass = SCL_1__MASK | SDA_1__MASK; // Both pins routed to I2C_1
+volatile uint16 sim_spim_txdata;
+
+// Interrupt controller
+static cyisraddress irq_handlers[SIM_IRQ_COUNT];
+static uint8_t irq_enabled[SIM_IRQ_COUNT];
+static uint8_t irq_pending[SIM_IRQ_COUNT];
+static uint8_t primask = 1; // Interrupts are off out of reset until CyGlobalIntEnable
+static uint8_t in_handler = 0;
+static void I2cInterrupt(void);
+static void SleepUntilInterrupt(void);
+static void RunDmaRequest(void);
+
+// Timers
+static uint8_t timer_1_running = 0;
+static uint8_t timer_3_running = 0;
+static uint64_t timer_1_next_us = 0;
+static uint64_t timer_3_next_us = 0;
+
+// Scripted actions, kept sorted by time
+#define SIM_MAX_ACTIONS 256
+typedef struct {
+    uint64_t time_us;
+    SimAction action;
+} SimTimedAction;
+static SimTimedAction actions[SIM_MAX_ACTIONS];
+static uint16_t action_count = 0;
+
+// Run control
+static jmp_buf run_exit;
+static uint64_t run_end_us = 0;
+static int run_result = 0;
+static int failures = 0;
+static struct timespec pass_start;
+
+// Pins. Buttons are active low.
+static uint8_t pin_pir = 0;
+static uint8_t pin_buttons[3] = {1, 1, 1};
+static uint8_t pin_load = 0;
+static uint8_t pin_scl = 1;
+static uint8_t pin_sda = 1;
+
+// MAX6920 chain: every SPIM_1 word shifts 12 bits in, LOAD copies the register to the outputs
+static uint64_t shift_register = 0;
+static SimLatchHook latch_hook = NULL;
+static uint8_t pwm_2_compare = 0;
+static uint8_t load_follows_ss = 0;    // The DMA TopDesign drives LOAD from SPIM_1's ss
+static uint8_t spim_words_pending = 0; // Shifted since ss last rose
+
+// DMA_Refresh: one channel stepping through a chain of TDs, one TD per Timer_1 request
+#define SIM_DMA_TDS 128
+typedef struct {
+    uint16 count;       // Bytes moved per request
+    uint8 next;
+    uint8 configuration;
+    uint16 source;      // Low halves; the DMAC supplies the upper halves per channel
+    uint16 destination;
+} SimDmaTd;
+static SimDmaTd dma_tds[SIM_DMA_TDS];
+static uint8_t dma_td_count = 0;
+static uint8_t dma_enabled = 0;
+static uint8_t dma_td = CY_DMA_INVALID_TD; // TD the next request runs
+
+// I2C_1 and the DS1307
+#define DS1307_ADDRESS 0x68
+static uint8_t i2c_started = 0;
+static uint8_t i2c_status = 0;
+static uint8_t i2c_busy = 0;
+static uint8_t i2c_hung = 0;        // A stalled slave holds SDA low
+static uint8_t i2c_mid_transfer = 0; // After a NO_STOP write, the bus still belongs to the master
+static uint64_t i2c_done_us = 0;
+static uint8_t i2c_done_status = 0;
+static uint8_t ds1307_pointer = 0;
+
+// UART_1
+#define SIM_UART_SIZE 4096
+static uint8_t uart_rx[SIM_UART_SIZE];
+static uint32_t uart_rx_head = 0;
+static uint32_t uart_rx_tail = 0;
+static uint8_t uart_tx[SIM_UART_SIZE];
+static uint32_t uart_tx_length = 0;
+
+static uint64_t HostNanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * Raises an interrupt request; it is taken at the next dispatch point.
+ */
+static void RaiseIrq(uint8_t irq) {
+    if (irq_handlers[irq] != NULL || irq == SIM_IRQ_I2C) {
+        irq_pending[irq] = 1;
+    }
+}
+
+/**
+ * Runs pending, enabled handlers until none is left. Returns the number run.
+ */
+static uint32_t RunPendingHandlers(void) {
+    uint32_t ran = 0;
+
+    for (uint8_t irq = 0; irq < SIM_IRQ_COUNT; irq++) {
+        if (!irq_pending[irq] || !irq_enabled[irq]) {
+            continue;
+        }
+        irq_pending[irq] = 0;
+        in_handler = 1;
+        uint64_t start = HostNanoseconds();
+        if (irq == SIM_IRQ_I2C) {
+            I2cInterrupt();
+        } else {
+            irq_handlers[irq]();
+        }
+        uint64_t elapsed = HostNanoseconds() - start;
+        in_handler = 0;
+
+        SimIsrStats *stats = &sim_stats.isr[irq];
+        stats->count++;
+        stats->total_ns += elapsed;
+        if (elapsed > stats->max_ns) {
+            stats->max_ns = elapsed;
+        }
+        ran++;
+        irq = (uint8_t)-1; // Rescan from the first source, as the NVIC would
+    }
+    return ran;
+}
+
+/**
+ * Takes pending interrupts unless PRIMASK or a running handler blocks them. With SLEEPONEXIT set,
+ * returning from the last handler puts the core back to sleep instead of resuming the thread.
+ */
+static void DispatchInterrupts(void) {
+    if (primask || in_handler) {
+        return;
+    }
+    while (RunPendingHandlers() != 0 && (sim_scb.SCR & SCB_SCR_SLEEPONEXIT_Msk)) {
+        SleepUntilInterrupt();
+        sim_stats.handler_wakes++;
+        clock_gettime(CLOCK_MONOTONIC, &pass_start); // The main-loop pass starts at the last wake
+    }
+}
+
+static uint8_t AnyInterruptPending(void) {
+    for (uint8_t irq = 0; irq < SIM_IRQ_COUNT; irq++) {
+        if (irq_pending[irq] && irq_enabled[irq]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static uint8_t BcdToValue(uint8_t bcd) {
+    return (uint8_t)((bcd >> 4) * 10 + (bcd & 0x0F));
+}
+
+static uint8_t ValueToBcd(uint8_t value) {
+    return (uint8_t)(((value / 10) << 4) | (value % 10));
+}
+
+/**
+ * Reads the DS1307 time registers in either hour mode, as seconds since midnight.
+ */
+uint32_t SimRtcTimeOfDay(void) {
+    const uint8_t *regs = sim_ds1307.regs;
+    uint32_t hours;
+
+    if (regs[2] & 0x40) {
+        hours = BcdToValue(regs[2] & 0x1F) % 12 + ((regs[2] & 0x20) ? 12 : 0);
+    } else {
+        hours = BcdToValue(regs[2] & 0x3F);
+    }
+    return hours * 3600 + BcdToValue(regs[1] & 0x7F) * 60u + BcdToValue(regs[0] & 0x7F);
+}
+
+void SimSetRtcTime(uint8_t hours, uint8_t minutes, uint8_t seconds) {
+    sim_ds1307.regs[0] = ValueToBcd(seconds);
+    sim_ds1307.regs[1] = ValueToBcd(minutes);
+    sim_ds1307.regs[2] = ValueToBcd(hours);
+    sim_ds1307.sub_second_us = 0;
+}
+
+void SimSetRtcTime12Hour(uint8_t hours, uint8_t minutes, uint8_t seconds) {
+    uint8_t hour12 = (hours % 12 == 0) ? 12 : hours % 12;
+
+    SimSetRtcTime(0, minutes, seconds);
+    sim_ds1307.regs[2] = (uint8_t)(0x40 | ((hours >= 12) ? 0x20 : 0) | ValueToBcd(hour12));
+}
+
+/**
+ * Advances the DS1307 by one second, keeping the hour mode of the hours register.
+ */
+static void Ds1307Second(void) {
+    uint8_t *regs = sim_ds1307.regs;
+    uint32_t time = (SimRtcTimeOfDay() + 1) % 86400;
+    uint8_t hours = (uint8_t)(time / 3600);
+
+    regs[0] = ValueToBcd((uint8_t)(time % 60));
+    regs[1] = ValueToBcd((uint8_t)(time / 60 % 60));
+    if (regs[2] & 0x40) {
+        uint8_t hour12 = (hours % 12 == 0) ? 12 : hours % 12;
+        regs[2] = (uint8_t)(0x40 | ((hours >= 12) ? 0x20 : 0) | ValueToBcd(hour12));
+    } else {
+        regs[2] = ValueToBcd(hours);
+    }
+}
+
+/**
+ * Moves virtual time forward, firing every timer, transfer, RTC second and scripted action on the way.
+ */
+static void AdvanceTo(uint64_t target_us) {
+    for (;;) {
+        uint64_t next = target_us;
+
+        if (timer_3_running && timer_3_next_us < next) {
+            next = timer_3_next_us;
+        }
+        if (timer_1_running && timer_1_next_us < next) {
+            next = timer_1_next_us;
+        }
+        if (i2c_busy && !i2c_hung && i2c_done_us < next) {
+            next = i2c_done_us;
+        }
+        if (action_count != 0 && actions[0].time_us < next) {
+            next = actions[0].time_us;
+        }
+
+        if (next < sim_now_us) {
+            next = sim_now_us; // Time never runs backwards, even for a deadline that is already due
+        }
+        uint64_t elapsed = next - sim_now_us;
+        if (!(sim_ds1307.regs[0] & 0x80)) {
+            sim_ds1307.sub_second_us += (uint32_t)elapsed;
+            while (sim_ds1307.sub_second_us >= 1000000) {
+                sim_ds1307.sub_second_us -= 1000000;
+                Ds1307Second();
+            }
+        }
+        sim_now_us = next;
+        sim_dwt.CYCCNT = (uint32_t)(sim_now_us * SIM_CYCLES_PER_US);
+
+        if (timer_3_running && timer_3_next_us <= sim_now_us) {
+            timer_3_next_us += SIM_TICK_PERIOD_US;
+            RaiseIrq(SIM_IRQ_TICK);
+        }
+        if (timer_1_running && timer_1_next_us <= sim_now_us) {
+            timer_1_next_us += SIM_MULTIPLEX_PERIOD_US;
+            RaiseIrq(SIM_IRQ_MULTIPLEX);
+            if (dma_enabled) {
+                RunDmaRequest(); // Timer_1's tc is also the channel's drq
+            }
+        }
+        if (i2c_busy && !i2c_hung && i2c_done_us <= sim_now_us) {
+            i2c_busy = 0;
+            i2c_status = i2c_done_status;
+            RaiseIrq(SIM_IRQ_I2C);
+        }
+        while (action_count != 0 && actions[0].time_us <= sim_now_us) {
+            SimAction action = actions[0].action;
+            memmove(&actions[0], &actions[1], (size_t)(--action_count) * sizeof(actions[0]));
+            action();
+        }
+
+        if (next >= target_us) {
+            return;
+        }
+    }
+}
+
+/**
+ * Earliest virtual time at which something can raise an interrupt, or UINT64_MAX.
+ */
+static uint64_t NextEventTime(void) {
+    uint64_t next = UINT64_MAX;
+
+    if (timer_3_running && irq_enabled[SIM_IRQ_TICK] && timer_3_next_us < next) {
+        next = timer_3_next_us;
+    }
+    if (timer_1_running && irq_enabled[SIM_IRQ_MULTIPLEX] && timer_1_next_us < next) {
+        next = timer_1_next_us;
+    }
+    if (i2c_busy && !i2c_hung && i2c_done_us < next) {
+        next = i2c_done_us;
+    }
+    if (action_count != 0 && actions[0].time_us < next) {
+        next = actions[0].time_us;
+    }
+    return next;
+}
+
+void SimAt(uint64_t time_us, SimAction action) {
+    if (action_count >= SIM_MAX_ACTIONS) {
+        SimFail("too many scripted actions");
+        return;
+    }
+    uint16_t i = action_count++;
+    while (i > 0 && actions[i - 1].time_us > time_us) {
+        actions[i] = actions[i - 1];
+        i--;
+    }
+    actions[i].time_us = time_us;
+    actions[i].action = action;
+}
+
+void SimSetPir(uint8_t level) {
+    if (level && !pin_pir) {
+        RaiseIrq(SIM_IRQ_PIR);
+    }
+    pin_pir = level ? 1 : 0;
+}
+
+void SimSetButton(uint8_t button, uint8_t pressed) {
+    pin_buttons[button] = pressed ? 0 : 1;
+}
+
+void SimUartReceive(const uint8_t *data, uint8_t length) {
+    for (uint8_t i = 0; i < length; i++) {
+        uart_rx[uart_rx_head++ % SIM_UART_SIZE] = data[i];
+    }
+    RaiseIrq(SIM_IRQ_UART);
+}
+
+const uint8_t *SimUartSent(uint32_t *length) {
+    *length = uart_tx_length;
+    return uart_tx;
+}
+
+void SimOnLatch(SimLatchHook hook) {
+    latch_hook = hook;
+}
+
+uint8_t SimPwmCompare(void) {
+    return pwm_2_compare;
+}
+
+int SimRunFirmware(uint64_t end_us) {
+    run_end_us = end_us;
+    if (setjmp(run_exit) == 0) {
+        pass_start.tv_sec = 0;
+        firmware_main();
+        SimFail("firmware main() returned");
+    }
+    return run_result;
+}
+
+void SimFail(const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    fprintf(stderr, "FAIL at %llu.%06llu s: ", (unsigned long long)(sim_now_us / 1000000),
+            (unsigned long long)(sim_now_us % 1000000));
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+    failures++;
+}
+
+int SimFailures(void) {
+    return failures;
+}
+
+// CyLib and CMSIS
+
+uint8 CyEnterCriticalSection(void) {
+    uint8 saved = primask;
+    primask = 1;
+    return saved;
+}
+
+void CyExitCriticalSection(uint8 savedIntrStatus) {
+    primask = savedIntrStatus;
+    DispatchInterrupts();
+}
+
+/**
+ * Busy-waits, taking each interrupt as it fires rather than one per source at the end.
+ */
+static void BusyWait(uint64_t microseconds) {
+    uint64_t end_us = sim_now_us + microseconds;
+
+    do {
+        uint64_t next = NextEventTime();
+        AdvanceTo((next < end_us) ? next : end_us);
+        DispatchInterrupts();
+    } while (sim_now_us < end_us);
+}
+
+void CyDelayUs(uint16 microseconds) {
+    BusyWait(microseconds);
+}
+
+void CyDelay(uint32 milliseconds) {
+    BusyWait((uint64_t)milliseconds * 1000);
+}
+
+void __disable_irq(void) {
+    primask = 1;
+}
+
+void __enable_irq(void) {
+    primask = 0;
+    DispatchInterrupts();
+}
+
+void __DMB(void) {
+}
+
+uint8 __CLZ(uint32 value) {
+    return (uint8)((value != 0) ? __builtin_clz(value) : 32);
+}
+
+/**
+ * Sleeps until the next interrupt request. As on the Cortex-M3, a request wakes the core even
+ * with PRIMASK set; its handler then runs once PRIMASK clears.
+ */
+void __WFI(void) {
+    uint64_t now = HostNanoseconds();
+    if (pass_start.tv_sec != 0 || pass_start.tv_nsec != 0) {
+        uint64_t pass = now - ((uint64_t)pass_start.tv_sec * 1000000000u + (uint64_t)pass_start.tv_nsec);
+        sim_stats.passes++;
+        sim_stats.pass_total_ns += pass;
+        if (pass > sim_stats.pass_max_ns) {
+            sim_stats.pass_max_ns = pass;
+        }
+    }
+
+    SleepUntilInterrupt();
+    sim_stats.wakes++;
+    clock_gettime(CLOCK_MONOTONIC, &pass_start);
+    DispatchInterrupts();
+}
+
+/**
+ * Runs virtual time forward until an enabled interrupt is pending, ending the run at run_end_us.
+ */
+static void SleepUntilInterrupt(void) {
+    while (!AnyInterruptPending()) {
+        uint64_t next = NextEventTime();
+        if (next > run_end_us) {
+            run_result = (next == UINT64_MAX) ? 1 : 0;
+            if (next == UINT64_MAX) {
+                SimFail("asleep with no interrupt source left");
+            }
+            AdvanceTo(run_end_us);
+            longjmp(run_exit, 1);
+        }
+        AdvanceTo(next);
+    }
+}
+
+// Interrupt components
+
+#define SIM_DEFINE_ISR(name, irq) \
+    void name##_StartEx(cyisraddress address) { \
+        irq_handlers[irq] = address; \
+        irq_pending[irq] = 0; \
+        irq_enabled[irq] = 1; \
+    } \
+    void name##_Stop(void) { irq_enabled[irq] = 0; } \
+    void name##_Enable(void) { irq_enabled[irq] = 1; } \
+    void name##_Disable(void) { irq_enabled[irq] = 0; } \
+    void name##_SetPending(void) { RaiseIrq(irq); } \
+    void name##_ClearPending(void) { irq_pending[irq] = 0; }
+
+SIM_DEFINE_ISR(isr_1, SIM_IRQ_MULTIPLEX)
+SIM_DEFINE_ISR(isr_6, SIM_IRQ_TICK)
+SIM_DEFINE_ISR(isr_PIR, SIM_IRQ_PIR)
+SIM_DEFINE_ISR(isr_UART, SIM_IRQ_UART)
+
+// Pins
+
+uint8 Pin_PIR_Read(void) { return pin_pir; }
+uint8 Pin_Brightness_Read(void) { return pin_buttons[SIM_BUTTON_BRIGHTNESS]; }
+uint8 Pin_Up_Read(void) { return pin_buttons[SIM_BUTTON_UP]; }
+uint8 Pin_Down_Read(void) { return pin_buttons[SIM_BUTTON_DOWN]; }
+uint8 Pin_LOAD_Read(void) { return pin_load; }
+
+uint8 Pin_PIR_ClearInterrupt(void) { return 0; }
+uint8 Pin_Brightness_ClearInterrupt(void) { return 0; }
+uint8 Pin_Up_ClearInterrupt(void) { return 0; }
+uint8 Pin_Down_ClearInterrupt(void) { return 0; }
+uint8 Pin_LOAD_ClearInterrupt(void) { return 0; }
+uint8 SCL_1_ClearInterrupt(void) { return 0; }
+uint8 SDA_1_ClearInterrupt(void) { return 0; }
+
+void Pin_PIR_Write(uint8 value) { (void)value; }
+void Pin_Brightness_Write(uint8 value) { (void)value; }
+void Pin_Up_Write(uint8 value) { (void)value; }
+void Pin_Down_Write(uint8 value) { (void)value; }
+
+void Pin_PIR_SetDriveMode(uint8 mode) { (void)mode; }
+void Pin_Brightness_SetDriveMode(uint8 mode) { (void)mode; }
+void Pin_Up_SetDriveMode(uint8 mode) { (void)mode; }
+void Pin_Down_SetDriveMode(uint8 mode) { (void)mode; }
+void Pin_LOAD_SetDriveMode(uint8 mode) { (void)mode; }
+void SCL_1_SetDriveMode(uint8 mode) { (void)mode; }
+void SDA_1_SetDriveMode(uint8 mode) { (void)mode; }
+
+/**
+ * Copies the MAX6920 shift register to the outputs.
+ */
+static void Latch(void) {
+    sim_stats.latches++;
+    spim_words_pending = 0;
+    if (latch_hook != NULL) {
+        latch_hook(shift_register);
+    }
+}
+
+void Pin_LOAD_Write(uint8 value) {
+    if (value && !pin_load) {
+        Latch();
+    }
+    pin_load = value ? 1 : 0;
+}
+
+/**
+ * SCL_1 as a GPIO (bypass bit clear). A rising edge clocks a stalled slave one bit further.
+ */
+void SCL_1_Write(uint8 value) {
+    if (sim_port12_bypass & SCL_1__MASK) {
+        return;
+    }
+    if (value && !pin_scl && i2c_hung && sim_ds1307.hang_clocks != 0 && --sim_ds1307.hang_clocks == 0) {
+        i2c_hung = 0;
+        i2c_busy = 0; // The stalled transfer never completes; the master was reset to clock it out
+        sim_stats.bus_recoveries++;
+    }
+    pin_scl = value ? 1 : 0;
+}
+
+uint8 SCL_1_Read(void) {
+    return pin_scl;
+}
+
+void SDA_1_Write(uint8 value) {
+    pin_sda = value ? 1 : 0;
+}
+
+uint8 SDA_1_Read(void) {
+    return (uint8)(pin_sda && !i2c_hung);
+}
+
+// SPIM_1
+
+void SPIM_1_Start(void) {
+}
+
+void SPIM_1_ClearTxBuffer(void) {
+}
+
+void SPIM_1_ClearRxBuffer(void) {
+}
+
+void SPIM_1_WriteTxData(uint16 txData) {
+    shift_register = (shift_register << 12) | (txData & 0x0FFFu);
+    spim_words_pending++;
+    sim_stats.spi_words++;
+}
+
+/**
+ * Words shift out as soon as they are written, so the transfer is always done. With LOAD on ss,
+ * the first look at SPI_DONE after a transfer is where ss has risen and the chain latched.
+ */
+uint8 SPIM_1_ReadStatus(void) {
+    if (load_follows_ss && spim_words_pending != 0) {
+        Latch();
+    }
+    return SPIM_1_STS_SPI_DONE | SPIM_1_STS_TX_FIFO_NOT_FULL;
+}
+
+uint8 SPIM_1_ReadTxStatus(void) {
+    return SPIM_1_STS_SPI_DONE | SPIM_1_STS_TX_FIFO_NOT_FULL;
+}
+
+// PWM_1, PWM_2
+
+void PWM_1_Start(void) {
+}
+
+void PWM_2_Start(void) {
+}
+
+void PWM_2_WriteCompare(uint8 compare) {
+    pwm_2_compare = compare;
+}
+
+// Timer_1, Timer_3
+
+void Timer_1_Start(void) {
+    if (!timer_1_running) {
+        timer_1_running = 1;
+        timer_1_next_us = sim_now_us + SIM_MULTIPLEX_PERIOD_US;
+    }
+}
+
+void Timer_1_Stop(void) {
+    timer_1_running = 0;
+}
+
+uint8 Timer_1_ReadStatusRegister(void) {
+    return 0;
+}
+
+void Timer_3_Start(void) {
+    if (!timer_3_running) {
+        timer_3_running = 1;
+        timer_3_next_us = sim_now_us + SIM_TICK_PERIOD_US;
+    }
+}
+
+uint8 Timer_3_ReadStatusRegister(void) {
+    return 0;
+}
+
+// I2C_1
+
+void I2C_1_Start(void) {
+    i2c_started = 1;
+    irq_enabled[SIM_IRQ_I2C] = 1;
+}
+
+/**
+ * Disables the block. A transfer in flight is dropped; a stalled slave keeps holding SDA.
+ */
+void I2C_1_Stop(void) {
+    i2c_started = 0;
+    i2c_busy = i2c_hung;
+    i2c_mid_transfer = 0;
+    irq_enabled[SIM_IRQ_I2C] = 0;
+    irq_pending[SIM_IRQ_I2C] = 0;
+}
+
+uint8 I2C_1_MasterStatus(void) {
+    return i2c_status;
+}
+
+uint8 I2C_1_MasterClearStatus(void) {
+    uint8 status = i2c_status;
+    i2c_status = 0;
+    return status;
+}
+
+/**
+ * Starts a transfer that completes SIM_I2C_BYTE_US per byte later, or stalls if the slave is set to hang.
+ */
+static uint8 StartTransfer(uint8 slaveAddress, uint8 bytes, uint8 done_status) {
+    if (!i2c_started || i2c_busy || (sim_port12_bypass & (SCL_1__MASK | SDA_1__MASK)) != (SCL_1__MASK | SDA_1__MASK)) {
+        return I2C_1_MSTR_BUS_BUSY;
+    }
+
+    sim_stats.i2c_transfers++;
+    i2c_busy = 1;
+    i2c_status = I2C_1_MSTAT_XFER_INP;
+    if (slaveAddress != DS1307_ADDRESS || !sim_ds1307.present) {
+        sim_stats.i2c_naks++;
+        sim_stats.i2c_bytes++;
+        i2c_done_status = I2C_1_MSTAT_ERR_ADDR_NAK;
+        i2c_done_us = sim_now_us + SIM_I2C_BYTE_US;
+        return 0xFF; // Address NAK: no data moves
+    }
+    if (sim_ds1307.hang_clocks != 0) {
+        i2c_hung = 1;
+        return 0xFF;
+    }
+
+    sim_stats.i2c_bytes += bytes + 1u;
+    i2c_done_status = done_status;
+    i2c_done_us = sim_now_us + (uint64_t)(bytes + 1u) * SIM_I2C_BYTE_US;
+    return I2C_1_MSTR_NO_ERROR;
+}
+
+uint8 I2C_1_MasterWriteBuf(uint8 slaveAddress, uint8 *wrData, uint8 cnt, uint8 mode) {
+    uint8 started = StartTransfer(slaveAddress, cnt, I2C_1_MSTAT_WR_CMPLT);
+    if (started == I2C_1_MSTR_BUS_BUSY) {
+        return started;
+    }
+    if (started == I2C_1_MSTR_NO_ERROR && cnt != 0) {
+        uint8_t pointer = wrData[0] & 0x3F;
+        for (uint8 i = 1; i < cnt; i++) {
+            if (pointer == 0) {
+                sim_ds1307.sub_second_us = 0; // Writing the seconds restarts the countdown chain
+            }
+            sim_ds1307.regs[pointer] = wrData[i];
+            pointer = (pointer + 1) & 0x3F;
+        }
+        ds1307_pointer = pointer;
+    }
+    i2c_mid_transfer = (mode & I2C_1_MODE_NO_STOP) ? 1 : 0;
+    return I2C_1_MSTR_NO_ERROR;
+}
+
+uint8 I2C_1_MasterReadBuf(uint8 slaveAddress, uint8 *rdData, uint8 cnt, uint8 mode) {
+    if ((mode & I2C_1_MODE_REPEAT_START) && !i2c_mid_transfer) {
+        return I2C_1_MSTR_BUS_BUSY;
+    }
+    i2c_mid_transfer = 0;
+
+    uint8 started = StartTransfer(slaveAddress, cnt, I2C_1_MSTAT_RD_CMPLT);
+    if (started == I2C_1_MSTR_BUS_BUSY) {
+        return started;
+    }
+    if (started == I2C_1_MSTR_NO_ERROR) {
+        for (uint8 i = 0; i < cnt; i++) {
+            rdData[i] = sim_ds1307.regs[ds1307_pointer];
+            ds1307_pointer = (ds1307_pointer + 1) & 0x3F;
+        }
+    }
+    return I2C_1_MSTR_NO_ERROR;
+}
+
+/**
+ * The component's ISR: its status is already latched, so only the exit callback remains.
+ */
+static void I2cInterrupt(void) {
+#ifdef I2C_1_ISR_EXIT_CALLBACK
+    I2C_1_ISR_ExitCallback();
+#endif
+}
+
+// UART_1
+
+void UART_1_Start(void) {
+}
+
+uint8 UART_1_ReadRxStatus(void) {
+    return (uart_rx_tail != uart_rx_head) ? UART_1_RX_STS_FIFO_NOTEMPTY : 0;
+}
+
+uint8 UART_1_ReadRxData(void) {
+    return (uart_rx_tail != uart_rx_head) ? uart_rx[uart_rx_tail++ % SIM_UART_SIZE] : 0;
+}
+
+void UART_1_PutArray(const uint8 string[], uint8 byteCount) {
+    for (uint8 i = 0; i < byteCount && uart_tx_length < SIM_UART_SIZE; i++) {
+        uart_tx[uart_tx_length++] = string[i];
+    }
+}
+
+// DMA_Refresh and CyDmac
+
+/**
+ * The DMAC reaches SRAM through 16-bit TD addresses under a per-channel upper half. On the host the
+ * firmware's frames sit in the same .bss as the simulator's own data, so the upper bits come from
+ * one of its variables: the address with the given low half nearest to it is the firmware's buffer.
+ */
+static const volatile uint8_t *DmaHostAddress(uint16 low) {
+    uintptr_t anchor = (uintptr_t)&sim_spim_txdata;
+    uintptr_t address = (anchor & ~(uintptr_t)0xFFFF) | low;
+
+    if (address > anchor + 0x8000) {
+        address -= 0x10000;
+    } else if (address + 0x8000 < anchor) {
+        address += 0x10000;
+    }
+    return (const volatile uint8_t *)address;
+}
+
+/**
+ * Runs the current TD for one Timer_1 request: its bytes go into the SPIM_1 FIFO as 16-bit words,
+ * ss rises once they have shifted out, and the channel moves on to the TD's next. The next link is
+ * only read here, at the end of the TD, which is what puts the firmware's chain swap on a frame boundary.
+ */
+static void RunDmaRequest(void) {
+    if (dma_td >= dma_td_count) {
+        dma_enabled = 0; // CY_DMA_DISABLE_TD or an unallocated TD ends the chain
+        return;
+    }
+
+    const SimDmaTd *td = &dma_tds[dma_td];
+    const volatile uint8_t *source = DmaHostAddress(td->source);
+    for (uint16 offset = 0; offset + 1 < td->count; offset += 2) {
+        uint16 at = (td->configuration & TD_INC_SRC_ADR) ? offset : 0;
+        SPIM_1_WriteTxData((uint16)(source[at] | (source[at + 1] << 8)));
+    }
+    Latch();
+    dma_td = td->next;
+}
+
+/**
+ * DMA_Refresh exists only in the DMA TopDesign, which also routes SPIM_1's ss to LOAD.
+ */
+uint8 DMA_Refresh_DmaInitialize(uint8 burstCount, uint8 requestPerBurst, uint16 upperSrcAddress, uint16 upperDestAddress) {
+    (void)requestPerBurst;
+    (void)upperSrcAddress;
+    (void)upperDestAddress;
+    if (burstCount != 2) {
+        SimFail("DMA_Refresh bursts of %u bytes; SPIM_1's FIFO takes one 16-bit word", burstCount);
+    }
+    load_follows_ss = 1;
+    return 0;
+}
+
+uint8 CyDmaTdAllocate(void) {
+    return (dma_td_count < SIM_DMA_TDS) ? dma_td_count++ : CY_DMA_INVALID_TD;
+}
+
+cystatus_t CyDmaTdSetConfiguration(uint8 tdHandle, uint16 transferCount, uint8 nextTd, uint8 configuration) {
+    if (tdHandle >= dma_td_count) {
+        SimFail("configuring unallocated TD %u", tdHandle);
+        return 1;
+    }
+    dma_tds[tdHandle].count = transferCount;
+    dma_tds[tdHandle].next = nextTd;
+    dma_tds[tdHandle].configuration = configuration;
+    return 0;
+}
+
+cystatus_t CyDmaTdSetAddress(uint8 tdHandle, uint16 source, uint16 destination) {
+    if (tdHandle >= dma_td_count) {
+        SimFail("addressing unallocated TD %u", tdHandle);
+        return 1;
+    }
+    if (destination != LO16((uintptr_t)&sim_spim_txdata)) {
+        SimFail("TD %u writes to %04X, not the SPIM_1 TX FIFO", tdHandle, destination);
+    }
+    dma_tds[tdHandle].source = source;
+    dma_tds[tdHandle].destination = destination;
+    return 0;
+}
+
+cystatus_t CyDmaChSetInitialTd(uint8 chHandle, uint8 startTd) {
+    (void)chHandle;
+    dma_td = startTd;
+    return 0;
+}
+
+cystatus_t CyDmaChEnable(uint8 chHandle, uint8 preserveTds) {
+    (void)chHandle;
+    (void)preserveTds; // The model never writes TDs back
+    dma_enabled = 1;
+    return 0;
+}
+
+cystatus_t CyDmaChDisable(uint8 chHandle) {
+    (void)chHandle;
+    dma_enabled = 0;
+    return 0;
+}
@@ -0,0 +1,1051 @@
+/******************************************************************************
+* File Name: sim_main.c
+*
+* Description: Scenario runner for the host simulator. Each scenario sets up
+* the virtual hardware, schedules stimuli and checks, and runs the unchanged
+* firmware for a stretch of virtual time:
+*
+*     vfd_sim <scenario> [arguments]
+*
+* main.c is compiled into the runner, once per option set, so the scenarios
+* use its constants and output map and can read its statistics directly.
+* The display is read back from the latched MAX6920 outputs.
+*
+*******************************************************************************/
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "sim.h"
+
+// Only main() is renamed, so the runner owns the entry point
+#define main firmware_main
+#include "main.c"
+#undef main
+
+#define SECONDS(s) ((uint64_t)(s) * 1000000u)
+#define MINUTES(m) SECONDS((uint64_t)(m) * 60u)
+#define HOURS(h) MINUTES((uint64_t)(h) * 60u)
+
+#define CLOCK_DIGITS 4 // HH:MM, which every geometry starts with
+
+static uint8_t shown_segments[DISPLAY_DIGITS];
+static uint64_t last_latch_us = 0;
+
+static uint8_t OutputOn(uint64_t outputs, uint8_t output) {
+    return (uint8_t)((outputs >> output) & 1u);
+}
+
+/**
+ * Records what each grid showed the last time it was strobed, through the firmware's output map.
+ */
+static void RecordLatch(uint64_t outputs) {
+    last_latch_us = sim_now_us;
+    for (uint8_t digit = 0; digit < DISPLAY_DIGITS; digit++) {
+        if (OutputOn(outputs, digit_grid_outputs[digit])) {
+            uint8_t segments = 0;
+            for (uint8_t segment = 0; segment < 7; segment++) {
+                segments |= (uint8_t)(OutputOn(outputs, segment_outputs[segment]) << segment);
+            }
+            shown_segments[digit] = segments;
+            return;
+        }
+    }
+}
+
+/**
+ * The digits as text; segments that are not a digit read as '?', dark ones as ' '.
+ */
+static void DisplayText(char *text) {
+    for (uint8_t digit = 0; digit < DISPLAY_DIGITS; digit++) {
+        text[digit] = (shown_segments[digit] == 0) ? ' ' : '?';
+        for (uint8_t value = 0; value < 10; value++) {
+            if (shown_segments[digit] == GlyphSegments((char)('0' + value))) {
+                text[digit] = (char)('0' + value);
+            }
+        }
+    }
+    text[DISPLAY_DIGITS] = '\0';
+}
+
+/**
+ * Lit means the PWM is driving the grids and the refresh has strobed in the last few slots.
+ */
+static uint8_t DisplayLit(void) {
+    return SimPwmCompare() != 0 && sim_now_us - last_latch_us < 5000;
+}
+
+/**
+ * The hour and minute a 12-hour HH:MM display shows for a time of day.
+ */
+static void ExpectedText(uint32_t time, char *text) {
+    uint32_t hour12 = (time / 3600) % 12;
+    snprintf(text, CLOCK_DIGITS + 1, "%02u%02u", (unsigned)(hour12 == 0 ? 12 : hour12), (unsigned)(time / 60 % 60));
+}
+
+/**
+ * Checks that the display shows the DS1307 time. Called away from minute boundaries, since the
+ * software clock and the RTC are up to a second apart.
+ */
+static void ExpectDisplayMatchesRtc(void) {
+    char shown[DISPLAY_DIGITS + 1];
+    char expected[CLOCK_DIGITS + 1];
+
+    DisplayText(shown);
+    ExpectedText(SimRtcTimeOfDay(), expected);
+    if (!DisplayLit()) {
+        SimFail("display dark, expected %s", expected);
+    } else if (strncmp(shown, expected, CLOCK_DIGITS) != 0) {
+        SimFail("display shows %s, RTC says %s", shown, expected);
+    }
+}
+
+/**
+ * Checks the HH:MM digits; a six-digit build's seconds are not compared.
+ */
+static void ExpectDisplay(const char *expected) {
+    char shown[DISPLAY_DIGITS + 1];
+
+    DisplayText(shown);
+    if (!DisplayLit()) {
+        SimFail("display dark, expected %s", expected);
+    } else if (strncmp(shown, expected, CLOCK_DIGITS) != 0) {
+        SimFail("display shows %s, expected %s", shown, expected);
+    }
+}
+
+static void PirHigh(void) {
+    SimSetPir(1);
+}
+
+static void PirLow(void) {
+    SimSetPir(0);
+}
+
+static void PressUp(void) {
+    SimSetButton(SIM_BUTTON_UP, 1);
+}
+
+static void ReleaseUp(void) {
+    SimSetButton(SIM_BUTTON_UP, 0);
+}
+
+static void PressDown(void) {
+    SimSetButton(SIM_BUTTON_DOWN, 1);
+}
+
+static void ReleaseDown(void) {
+    SimSetButton(SIM_BUTTON_DOWN, 0);
+}
+
+static void PressBrightness(void) {
+    SimSetButton(SIM_BUTTON_BRIGHTNESS, 1);
+}
+
+static void ReleaseBrightness(void) {
+    SimSetButton(SIM_BUTTON_BRIGHTNESS, 0);
+}
+
+static char **scenario_arguments; // After the scenario name, NULL-terminated
+
+// Scenarios
+
+static void ExpectBootTime(void) {
+    ExpectDisplay("0941");
+}
+
+/**
+ * The boot timing milestones come in order, and the restored time is on the tube within 10 ms.
+ */
+static void ExpectBootStats(void) {
+    const uint32_t cycles_per_ms = SIM_CYCLES_PER_US * 1000;
+    uint32_t restore = boot_stats.restore_cycles;
+    uint32_t publish = boot_stats.publish_cycles;
+    uint32_t first_frame = boot_stats.first_frame_cycles;
+
+    if (restore == 0 || publish < restore || first_frame < publish) {
+        SimFail("boot cycles out of order: restore %u, publish %u, first frame %u", (unsigned)restore,
+                (unsigned)publish, (unsigned)first_frame);
+    }
+    if (first_frame >= 10 * cycles_per_ms) {
+        SimFail("first frame after %u.%03u ms", (unsigned)(first_frame / cycles_per_ms),
+                (unsigned)(first_frame % cycles_per_ms * 1000 / cycles_per_ms));
+    }
+}
+
+static void ExpectMinuteRollover(void) {
+    ExpectDisplay("0942");
+}
+
+/**
+ * Boot restores the DS1307 time and lights the display without waiting for motion.
+ */
+static void ScenarioBoot(void) {
+    SimSetRtcTime(9, 41, 30);
+    SimAt(SECONDS(2), ExpectBootTime);
+    SimAt(SECONDS(2), ExpectBootStats);
+    SimAt(SECONDS(45), ExpectMinuteRollover);
+    SimRunFirmware(SECONDS(50));
+}
+
+static void CheckEveryElevenMinutes(void) {
+    ExpectDisplayMatchesRtc();
+    if (sim_now_us + MINUTES(11) < HOURS(26)) {
+        SimAt(sim_now_us + MINUTES(11), CheckEveryElevenMinutes);
+    }
+}
+
+/**
+ * A day and a bit across midnight and noon, with someone in the room: the display tracks the RTC
+ * and the bus only carries the hourly resyncs and the occupancy writes. Checking every 11 minutes
+ * shows every hour and every minute value on the display at least once.
+ */
+static void ScenarioDay(void) {
+    SimSetRtcTime(23, 50, 0);
+    SimAt(SECONDS(1), PirHigh);
+    SimAt(SECONDS(30), CheckEveryElevenMinutes);
+    SimRunFirmware(HOURS(26));
+
+    if (sim_stats.i2c_transfers > 200) {
+        SimFail("%u I2C transfers in 26 hours", (unsigned)sim_stats.i2c_transfers);
+    }
+
+    // The tick and the refresh sleep on exit; the loop should only come round for its own work
+    if (sim_stats.wakes > 26u * 3600u * 20u) {
+        SimFail("%u main-loop wakes in 26 hours", (unsigned)sim_stats.wakes);
+    }
+}
+
+static void ExpectFallbackTime(void) {
+    ExpectDisplay("1212");
+}
+
+/**
+ * No DS1307: the clock starts at 12:12 and runs from the tick, and the breaker keeps the bus quiet.
+ */
+static void ScenarioRtcMissing(void) {
+    sim_ds1307.present = 0;
+    SimAt(SECONDS(1), PirHigh);
+    SimAt(SECONDS(40), ExpectFallbackTime);
+    SimRunFirmware(HOURS(1));
+
+    if (sim_stats.i2c_transfers > 60) {
+        SimFail("%u I2C transfers in an hour with no RTC", (unsigned)sim_stats.i2c_transfers);
+    }
+}
+
+static void ExpectRepairedRtc(void) {
+    ExpectDisplay("1111");
+    uint32_t rtc = SimRtcTimeOfDay();
+    if (rtc / 60 != 11 * 60 + 11) {
+        SimFail("RTC at %02u:%02u, expected it rewritten to 11:11", (unsigned)(rtc / 3600), (unsigned)(rtc / 60 % 60));
+    }
+}
+
+/**
+ * Time registers that are not BCD (minutes 0x7A) are rejected at boot: the clock restarts at
+ * 11:11 and rewrites the DS1307, as for a halted oscillator.
+ */
+static void ScenarioRtcCorrupt(void) {
+    SimSetRtcTime(4, 0, 0);
+    sim_ds1307.regs[1] = 0x7A;
+    SimAt(SECONDS(1), PirHigh);
+    SimAt(SECONDS(20), ExpectRepairedRtc);
+    SimRunFirmware(SECONDS(25));
+}
+
+/**
+ * A DS1307 stuck mid-byte at boot: the watchdog aborts, the breaker trips, and the recovery
+ * clocks free the bus so the probe restores the real time.
+ */
+static void ScenarioStuckBus(void) {
+    SimSetRtcTime(7, 30, 10);
+    sim_ds1307.hang_clocks = 5;
+    SimAt(SECONDS(1), PirHigh);
+    SimAt(SECONDS(20), ExpectDisplayMatchesRtc);
+    SimRunFirmware(SECONDS(25));
+
+    if (sim_stats.bus_recoveries != 1) {
+        SimFail("%u bus recoveries, expected 1", (unsigned)sim_stats.bus_recoveries);
+    }
+}
+
+static void ExpectDark(void) {
+    if (DisplayLit()) {
+        SimFail("display still lit");
+    }
+}
+
+static void ExpectWokenTime(void) {
+    ExpectDisplay("0805");
+}
+
+/**
+ * Motion after the display has timed out wakes it within one PIR poll, with or without isr_PIR.
+ */
+static void ScenarioPirWake(void) {
+    SimSetRtcTime(8, 0, 30);
+    SimAt(MINUTES(4), ExpectDark);
+    SimAt(MINUTES(5), PirHigh);
+    SimAt(MINUTES(5) + 150000, ExpectWokenTime);
+    SimAt(MINUTES(5) + SECONDS(2), PirLow);
+    SimRunFirmware(MINUTES(5) + SECONDS(3));
+}
+
+static void SetScheduleEntry(uint8_t index, uint8_t action, uint8_t hour, uint8_t minute, uint8_t argument) {
+    uint8_t *entry = &sim_ds1307.regs[NVRAM_SCHEDULE_ADDRESS + index * SCHEDULE_ENTRY_SIZE];
+    entry[0] = SCHEDULE_TAG | action;
+    entry[1] = hour;
+    entry[2] = minute;
+    entry[3] = argument;
+}
+
+static void ExpectHeldTime(void) {
+    ExpectDisplay("0555");
+}
+
+/**
+ * Booting inside a 22:00-06:00 hold window holds the display on with nobody in the room; the
+ * release at 06:00 then lets it time out.
+ */
+static void ScenarioScheduleHoldAtBoot(void) {
+    SimSetRtcTime(5, 50, 0);
+    SetScheduleEntry(0, SCHEDULE_HOLD_DISPLAY, 22, 0, 1);
+    SetScheduleEntry(1, SCHEDULE_HOLD_DISPLAY, 6, 0, 0);
+    SimAt(MINUTES(5) + SECONDS(30), ExpectHeldTime);
+    SimAt(MINUTES(15), ExpectDark);
+    SimRunFirmware(MINUTES(15) + SECONDS(1));
+}
+
+static void ExpectManualBrightness(void) {
+    if (brightness_level != 0) {
+        SimFail("brightness level %u after setting the time, expected the manual 0", brightness_level);
+    }
+}
+
+static void ExpectScheduledBrightness(void) {
+    if (brightness_level != 2) {
+        SimFail("brightness level %u after the 08:00 event, expected 2", brightness_level);
+    }
+}
+
+/**
+ * Setting the time within the 06:00-08:00 brightness window keeps a level chosen by hand in it; the
+ * 08:00 event then applies as usual.
+ */
+static void ScenarioScheduleManualBrightness(void) {
+    SimSetRtcTime(7, 58, 30);
+    SetScheduleEntry(0, SCHEDULE_BRIGHTNESS, 6, 0, BRIGHTNESS_LEVELS - 1);
+    SetScheduleEntry(1, SCHEDULE_BRIGHTNESS, 8, 0, 2);
+    SimAt(SECONDS(1), PirHigh);
+    SimAt(SECONDS(2), PressBrightness); // From the top level round to 0
+    SimAt(SECONDS(2) + 100000, ReleaseBrightness);
+    SimAt(SECONDS(20), PressUp); // 07:58:50 to 07:59:00
+    SimAt(SECONDS(20) + 100000, ReleaseUp);
+    SimAt(SECONDS(60), ExpectManualBrightness);
+    SimAt(SECONDS(120), ExpectScheduledBrightness);
+    SimRunFirmware(SECONDS(121));
+}
+
+static void SetRtcFourSecondsSlow(void) {
+    uint32_t time = SimRtcTimeOfDay() - 4;
+    SimSetRtcTime((uint8_t)(time / 3600), (uint8_t)(time / 60 % 60), (uint8_t)(time % 60));
+}
+
+/**
+ * A resync that steps the clock back across an event does not run it twice: the one-minute
+ * DISPLAY_ON at 08:00 ends a minute after it first fired, not a minute after the clock came round again.
+ */
+static void ScenarioScheduleStepBack(void) {
+    SimSetRtcTime(7, 0, 2);
+    SetScheduleEntry(0, SCHEDULE_DISPLAY_ON, 8, 0, 1);
+    SimAt(SECONDS(3500), SetRtcFourSecondsSlow); // The hourly resync at 08:00:02 steps back to 07:59:58
+    SimAt(SECONDS(3598 + 30), ExpectDisplayMatchesRtc);
+    SimAt(SECONDS(3598 + 62), ExpectDark);
+    SimRunFirmware(SECONDS(3598 + 63));
+}
+
+static void ExpectOneMinuteLater(void) {
+    ExpectDisplay("1001");
+    uint32_t rtc = SimRtcTimeOfDay();
+    if (rtc / 60 != 10 * 60 + 1) {
+        SimFail("RTC at %02u:%02u after setting, expected 10:01", (unsigned)(rtc / 3600), (unsigned)(rtc / 60 % 60));
+    }
+}
+
+/**
+ * A short UP press moves the time on by a minute and the DS1307 is written once the buttons go idle.
+ */
+static void ScenarioSetTime(void) {
+    SimSetRtcTime(10, 0, 5);
+    SimAt(SECONDS(1), PirHigh);
+    SimAt(SECONDS(2), PressUp);
+    SimAt(SECONDS(2) + 100000, ReleaseUp);
+    SimAt(SECONDS(12), ExpectOneMinuteLater);
+    SimRunFirmware(SECONDS(13));
+}
+
+static void ExpectOneMinuteEarlier(void) {
+    ExpectDisplay("1000");
+    uint32_t rtc = SimRtcTimeOfDay();
+    if (rtc / 60 != 10 * 60) {
+        SimFail("RTC at %02u:%02u after setting, expected 10:00", (unsigned)(rtc / 3600), (unsigned)(rtc / 60 % 60));
+    }
+}
+
+/**
+ * A DOWN press at 10:01:30 moves the clock back to 10:00:00. Every register differs from the ones read
+ * at boot (10:00:20, 12-hour mode) except the hours, but the RTC has moved on since, so a write of only
+ * the registers that changed against the boot read would leave the RTC at 10:01.
+ */
+static void ScenarioSetTime12Hour(void) {
+    SimSetRtcTime12Hour(10, 0, 20);
+    SimAt(SECONDS(1), PirHigh);
+    SimAt(SECONDS(70), PressDown);
+    SimAt(SECONDS(70) + 100000, ReleaseDown);
+    SimAt(SECONDS(80), ExpectOneMinuteEarlier);
+    SimRunFirmware(SECONDS(81));
+}
+
+// A task that busy-waits a known share of every period
+#define LOAD_PERIOD_MS 10
+#define LOAD_BUSY_US 2500
+#define LOAD_PERMILLE (LOAD_BUSY_US / LOAD_PERIOD_MS)
+
+static void LoadTask(void) {
+    CyDelayUs(LOAD_BUSY_US);
+}
+
+static void AddLoadTask(void) {
+    RegisterTask(LoadTask, LOAD_PERIOD_MS, 0);
+}
+
+static void ExpectCpuUtilisation(uint16_t expected) {
+    uint16_t measured = scheduler_stats.cpu_utilisation_permille;
+    if (measured + 10 < expected || measured > expected + 10) {
+        SimFail("CPU utilisation %u permille, expected %u", measured, expected);
+    }
+}
+
+static void ExpectIdleCpu(void) {
+    ExpectCpuUtilisation(0); // Firmware code takes no virtual time; only the load does
+}
+
+static void ExpectLoadedCpu(void) {
+    ExpectCpuUtilisation(LOAD_PERMILLE);
+}
+
+/**
+ * The scheduler's utilisation window reads zero while idle and the load's share once a whole window
+ * has run with it.
+ */
+static void ScenarioCpuLoad(void) {
+    SimSetRtcTime(9, 41, 30);
+    SimAt(SECONDS(1), PirHigh);
+    SimAt(SECONDS(1) + 500000, ExpectIdleCpu);
+    SimAt(SECONDS(1) + 500000, AddLoadTask);
+    SimAt(SECONDS(3) + 500000, ExpectLoadedCpu);
+    SimRunFirmware(SECONDS(4));
+}
+
+#if (DISPLAY_TRACE)
+// Display trace: the firmware's own analyzer against the known multiplex timing, plus a VCD of the
+// latched outputs for a waveform viewer
+
+#define VCD_OUTPUTS (DISPLAY_CHAIN_LENGTH * MAX6920_OUTPUTS)
+
+static FILE *vcd = NULL;
+static uint64_t vcd_outputs = 0;
+
+/**
+ * Names an output after what the firmware's output map drives with it.
+ */
+static void VcdOutputName(uint8_t output, char *name, size_t size) {
+    for (uint8_t segment = 0; segment < 7; segment++) {
+        if (segment_outputs[segment] == output) {
+            snprintf(name, size, "seg_%c", 'a' + segment);
+            return;
+        }
+    }
+    for (uint8_t digit = 0; digit < DISPLAY_DIGITS; digit++) {
+        if (digit_grid_outputs[digit] == output) {
+            snprintf(name, size, "grid%u", digit);
+            return;
+        }
+    }
+    for (uint8_t dot = 0; dot < sizeof(dots_outputs); dot++) {
+        if (dots_outputs[dot] == output) {
+            snprintf(name, size, "dots%u", dot);
+            return;
+        }
+    }
+    snprintf(name, size, "out%u", output);
+}
+
+static void OpenVcd(const char *path) {
+    vcd = fopen(path, "w");
+    if (vcd == NULL) {
+        SimFail("cannot write %s", path);
+        return;
+    }
+    fprintf(vcd, "$timescale 1us $end\n$scope module max6920 $end\n");
+    for (uint8_t output = 0; output < VCD_OUTPUTS; output++) {
+        char name[16];
+        VcdOutputName(output, name, sizeof(name));
+        fprintf(vcd, "$var wire 1 %c %s $end\n", '!' + output, name);
+    }
+    fprintf(vcd, "$upscope $end\n$enddefinitions $end\n#0\n$dumpvars\n");
+    for (uint8_t output = 0; output < VCD_OUTPUTS; output++) {
+        fprintf(vcd, "0%c\n", '!' + output);
+    }
+    fprintf(vcd, "$end\n");
+}
+
+/**
+ * Latch hook: writes the outputs that changed at this strobe.
+ */
+static void RecordVcdLatch(uint64_t outputs) {
+    uint64_t changed = (outputs ^ vcd_outputs) & ((1ULL << VCD_OUTPUTS) - 1);
+
+    RecordLatch(outputs);
+    if (vcd == NULL || changed == 0) {
+        return;
+    }
+    fprintf(vcd, "#%llu\n", (unsigned long long)sim_now_us);
+    for (uint8_t output = 0; output < VCD_OUTPUTS; output++) {
+        if (changed & (1ULL << output)) {
+            fprintf(vcd, "%c%c\n", OutputOn(outputs, output) ? '1' : '0', '!' + output);
+        }
+    }
+    vcd_outputs = outputs;
+}
+
+/**
+ * Each grid is lit for one slot in DISPLAY_SLOTS, so the analyzer must see that duty, one lit period
+ * per frame, and a dark gap of the other slots.
+ */
+static void ExpectTraceAnalysis(void) {
+    const uint32_t frame_us = DISPLAY_SLOTS * SIM_MULTIPLEX_PERIOD_US;
+    const uint32_t refresh_millihz = 1000000000u / frame_us;
+    const uint32_t gap_cycles = (DISPLAY_SLOTS - 1) * SIM_MULTIPLEX_PERIOD_US * SIM_CYCLES_PER_US;
+    DisplayTraceReport report;
+
+    if (!AnalyzeDisplayTrace(&report)) {
+        SimFail("display trace too short to analyse");
+        return;
+    }
+    if (report.refresh_millihz < refresh_millihz * 98 / 100 || report.refresh_millihz > refresh_millihz * 102 / 100) {
+        SimFail("refresh %u mHz, expected %u", (unsigned)report.refresh_millihz, (unsigned)refresh_millihz);
+    }
+    for (uint8_t grid = 0; grid < DISPLAY_DIGITS; grid++) {
+        uint16_t duty = report.duty_permille[grid];
+        uint32_t gap = report.worst_gap_cycles[grid];
+
+        if (duty + 10 < 1000 / DISPLAY_SLOTS || duty > 1000 / DISPLAY_SLOTS + 10) {
+            SimFail("grid %u duty %u permille, expected %u", grid, duty, 1000 / DISPLAY_SLOTS);
+        }
+        // The ISR's entry latency moves each latch by a few cycles
+        if (gap + 100 < gap_cycles || gap > gap_cycles + 100) {
+            SimFail("grid %u worst gap %u cycles, expected %u", grid, (unsigned)gap, (unsigned)gap_cycles);
+        }
+    }
+    printf("refresh %u.%03u Hz, grid 0 duty %u permille, worst gap %u cycles\n",
+           (unsigned)(report.refresh_millihz / 1000), (unsigned)(report.refresh_millihz % 1000),
+           report.duty_permille[0], (unsigned)report.worst_gap_cycles[0]);
+}
+
+/**
+ * Analyses the trace of a steadily lit display: vfd_sim_options display_trace [VCD file].
+ */
+static void ScenarioDisplayTrace(void) {
+    if (scenario_arguments[0] != NULL) {
+        OpenVcd(scenario_arguments[0]);
+        SimOnLatch(RecordVcdLatch);
+    }
+    SimSetRtcTime(9, 41, 30);
+    SimAt(SECONDS(1), PirHigh);
+    SimAt(SECONDS(5), ExpectTraceAnalysis);
+    SimRunFirmware(SECONDS(5) + 100000);
+    if (vcd != NULL) {
+        fclose(vcd);
+    }
+}
+#endif
+
+#if (SERIAL_PROTOCOL)
+// Serial protocol, driven through the UART model and checked against the firmware's own framing
+
+#define SERIAL_FRAME_MAX (SERIAL_HEADER + SERIAL_MAX_PAYLOAD + 1)
+
+static uint32_t serial_replies_read = 0; // Bytes of SimUartSent already parsed
+
+/**
+ * Frames a command the way a host would. Returns the frame length.
+ */
+static uint8_t BuildSerialFrame(uint8_t *frame, uint8_t command, const uint8_t *payload, uint8_t length) {
+    uint8_t crc = 0;
+
+    frame[0] = SERIAL_SYNC;
+    frame[1] = command;
+    frame[2] = length;
+    memcpy(&frame[SERIAL_HEADER], payload, length);
+    for (uint8_t i = 1; i < SERIAL_HEADER + length; i++) {
+        crc = Crc8Update(crc, frame[i]);
+    }
+    frame[SERIAL_HEADER + length] = crc;
+    return (uint8_t)(SERIAL_HEADER + length + 1);
+}
+
+/**
+ * Parses the next reply and checks its command and status. Returns the payload length after the
+ * status byte, or -1 (after failing the scenario) if there is no well-formed reply.
+ */
+static int ExpectSerialReply(uint8_t command, uint8_t status, uint8_t *payload) {
+    uint32_t sent;
+    const uint8_t *data = SimUartSent(&sent);
+    const uint8_t *frame = &data[serial_replies_read];
+    uint32_t available = sent - serial_replies_read;
+
+    if (available < SERIAL_HEADER + 1 || frame[0] != SERIAL_SYNC || available < SERIAL_HEADER + frame[2] + 1u) {
+        SimFail("no reply to command %02X", command);
+        return -1;
+    }
+    uint8_t length = frame[2];
+    uint8_t crc = 0;
+    for (uint8_t i = 1; i < SERIAL_HEADER + length; i++) {
+        crc = Crc8Update(crc, frame[i]);
+    }
+    serial_replies_read += SERIAL_HEADER + length + 1u;
+
+    if (crc != frame[SERIAL_HEADER + length] || length == 0) {
+        SimFail("malformed reply to command %02X", command);
+        return -1;
+    }
+    if (frame[1] != (command | SERIAL_REPLY) || frame[SERIAL_HEADER] != status) {
+        SimFail("reply %02X status %u, expected %02X status %u", frame[1], frame[SERIAL_HEADER],
+                command | SERIAL_REPLY, status);
+        return -1;
+    }
+    if (payload != NULL) {
+        memcpy(payload, &frame[SERIAL_HEADER + 1], length - 1u);
+    }
+    return length - 1;
+}
+
+static void ExpectNoSerialReply(void) {
+    uint32_t sent;
+    SimUartSent(&sent);
+    if (sent != serial_replies_read) {
+        SimFail("%u unexpected reply bytes", (unsigned)(sent - serial_replies_read));
+        serial_replies_read = sent;
+    }
+}
+
+static uint32_t LittleEndian32(const uint8_t *buffer) {
+    return buffer[0] | ((uint32_t)buffer[1] << 8) | ((uint32_t)buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+/**
+ * Line noise (including a sync with an impossible length), then a ping with a bad CRC, then a good
+ * ping, all in one chunk: the parser drops the noise and the bad frame and answers only the good one.
+ */
+static void SerialNoiseThenPing(void) {
+    static const uint8_t noise[] = {0x00, 0x37, SERIAL_SYNC, SERIAL_CMD_PING, SERIAL_MAX_PAYLOAD + 1, 0x12};
+    uint8_t chunk[sizeof(noise) + 2 * SERIAL_FRAME_MAX];
+    uint8_t length = sizeof(noise);
+
+    memcpy(chunk, noise, sizeof(noise));
+    uint8_t bad = BuildSerialFrame(&chunk[length], SERIAL_CMD_PING, NULL, 0);
+    chunk[length + bad - 1] ^= 0x01;
+    length += bad;
+    length += BuildSerialFrame(&chunk[length], SERIAL_CMD_PING, NULL, 0);
+    SimUartReceive(chunk, length);
+}
+
+static void ExpectPingReply(void) {
+    uint8_t payload[SERIAL_MAX_PAYLOAD];
+
+    if (ExpectSerialReply(SERIAL_CMD_PING, SERIAL_OK, payload) == 1 && payload[0] != SERIAL_VERSION) {
+        SimFail("protocol version %u, expected %u", payload[0], SERIAL_VERSION);
+    }
+    ExpectNoSerialReply();
+    if (serial_bad_frames != 2) {
+        SimFail("%u bad frames counted, expected 2", (unsigned)serial_bad_frames);
+    }
+}
+
+// SET_TIME 12:34:56, split across two chunks
+static uint8_t set_time_frame[SERIAL_FRAME_MAX];
+
+static void SerialSetTimeFirstHalf(void) {
+    static const uint8_t time[] = {12, 34, 56};
+    BuildSerialFrame(set_time_frame, SERIAL_CMD_SET_TIME, time, sizeof(time));
+    SimUartReceive(set_time_frame, 4);
+}
+
+static void SerialSetTimeSecondHalf(void) {
+    ExpectNoSerialReply(); // Still waiting for the rest of the frame
+    SimUartReceive(&set_time_frame[4], SERIAL_HEADER + 3 + 1 - 4);
+}
+
+static void ExpectSerialTimeSet(void) {
+    ExpectSerialReply(SERIAL_CMD_SET_TIME, SERIAL_OK, NULL);
+    ExpectDisplay("1234");
+    if (SimRtcTimeOfDay() / 60 != 12 * 60 + 34) {
+        SimFail("RTC not written by SET_TIME");
+    }
+}
+
+static void SerialBadSetTimes(void) {
+    static const uint8_t bad_hour[] = {24, 0, 0};
+    static const uint8_t short_time[] = {12, 0};
+    uint8_t chunk[2 * SERIAL_FRAME_MAX];
+    uint8_t length = BuildSerialFrame(chunk, SERIAL_CMD_SET_TIME, bad_hour, sizeof(bad_hour));
+
+    length += BuildSerialFrame(&chunk[length], SERIAL_CMD_SET_TIME, short_time, sizeof(short_time));
+    SimUartReceive(chunk, length);
+}
+
+static void ExpectBadSetTimeReplies(void) {
+    ExpectSerialReply(SERIAL_CMD_SET_TIME, SERIAL_BAD_VALUE, NULL);
+    ExpectSerialReply(SERIAL_CMD_SET_TIME, SERIAL_BAD_LENGTH, NULL);
+    ExpectDisplay("1234");
+}
+
+/**
+ * Four schedule writes fill the DS1307 queue before any of them completes, so the SET_TIME behind
+ * them in the same chunk cannot queue its RTC write.
+ */
+static void SerialSetTimeBehindFullQueue(void) {
+    static const uint8_t time[] = {8, 15, 0};
+    uint8_t chunk[(DS1307_QUEUE_SIZE + 1) * SERIAL_FRAME_MAX];
+    uint32_t length = 0;
+
+    for (uint8_t i = 0; i < DS1307_QUEUE_SIZE; i++) {
+        const uint8_t free_entry[1 + SCHEDULE_ENTRY_SIZE] = {i, 0, 0, 0, 0};
+        length += BuildSerialFrame(&chunk[length], SERIAL_CMD_SET_SCHEDULE, free_entry, sizeof(free_entry));
+    }
+    length += BuildSerialFrame(&chunk[length], SERIAL_CMD_SET_TIME, time, sizeof(time));
+    SimUartReceive(chunk, (uint8_t)length);
+}
+
+static void ExpectSetTimeBusy(void) {
+    for (uint8_t i = 0; i < DS1307_QUEUE_SIZE; i++) {
+        ExpectSerialReply(SERIAL_CMD_SET_SCHEDULE, SERIAL_OK, NULL);
+    }
+    ExpectSerialReply(SERIAL_CMD_SET_TIME, SERIAL_BUSY, NULL);
+    ExpectDisplay("0815"); // The clock is set even though the RTC write is not queued yet
+}
+
+static void ExpectRetriedTimeWrite(void) {
+    if (SimRtcTimeOfDay() / 60 != 8 * 60 + 15) {
+        SimFail("RTC write after BUSY not retried");
+    }
+}
+
+static void SerialTelemetry(void) {
+    uint8_t frame[SERIAL_FRAME_MAX];
+    SimUartReceive(frame, BuildSerialFrame(frame, SERIAL_CMD_TELEMETRY, NULL, 0));
+}
+
+static void ExpectTelemetryReply(void) {
+    uint8_t payload[SERIAL_MAX_PAYLOAD];
+    int length = ExpectSerialReply(SERIAL_CMD_TELEMETRY, SERIAL_OK, payload);
+
+    if (length < 0) {
+        return;
+    }
+    if (length != (int)sizeof(Telemetry)) {
+        SimFail("telemetry is %d bytes, expected %u", length, (unsigned)sizeof(Telemetry));
+        return;
+    }
+    // Boot read, occupancy and schedule reads, two time writes and the four schedule writes
+    uint32_t transactions = LittleEndian32(&payload[offsetof(Telemetry, i2c_transactions)]);
+    uint32_t on_ms = LittleEndian32(&payload[offsetof(Telemetry, display_on_ms)]);
+    if (transactions < 9 || transactions != telemetry.i2c_transactions) {
+        SimFail("%u I2C transactions reported, firmware counted %u", (unsigned)transactions,
+                (unsigned)telemetry.i2c_transactions);
+    }
+    if (on_ms == 0 || on_ms > sim_now_us / 1000) {
+        SimFail("display on for %u ms after %u ms", (unsigned)on_ms, (unsigned)(sim_now_us / 1000));
+    }
+}
+
+static uint32_t isr_stats_requested_ms;
+
+static void SerialIsrStats(void) {
+    static const uint8_t tick[] = {ISR_ID_TICK};
+    static const uint8_t unknown[] = {ISR_PROFILE_COUNT};
+    uint8_t chunk[2 * SERIAL_FRAME_MAX];
+    uint8_t length = BuildSerialFrame(chunk, SERIAL_CMD_ISR_STATS, tick, sizeof(tick));
+
+    length += BuildSerialFrame(&chunk[length], SERIAL_CMD_ISR_STATS, unknown, sizeof(unknown));
+    SimUartReceive(chunk, length);
+    isr_stats_requested_ms = (uint32_t)(sim_now_us / 1000);
+}
+
+static void ExpectIsrStatsReplies(void) {
+#if (ISR_PROFILING)
+    uint8_t payload[SERIAL_MAX_PAYLOAD];
+
+    if (ExpectSerialReply(SERIAL_CMD_ISR_STATS, SERIAL_OK, payload) == 16) {
+        uint32_t count = LittleEndian32(&payload[0]);
+        uint32_t min = LittleEndian32(&payload[4]);
+        uint32_t max = LittleEndian32(&payload[8]);
+        uint32_t mean = LittleEndian32(&payload[12]);
+
+        // One tick per millisecond since the tick timer started
+        if (count + 10 < isr_stats_requested_ms || count > isr_stats_requested_ms) {
+            SimFail("%u tick ISRs in %u ms", (unsigned)count, (unsigned)isr_stats_requested_ms);
+        }
+        if (min > mean || mean > max) {
+            SimFail("tick ISR cycles min %u mean %u max %u", (unsigned)min, (unsigned)mean, (unsigned)max);
+        }
+    }
+    ExpectSerialReply(SERIAL_CMD_ISR_STATS, SERIAL_BAD_VALUE, NULL);
+#else
+    ExpectSerialReply(SERIAL_CMD_ISR_STATS, SERIAL_UNSUPPORTED, NULL);
+    ExpectSerialReply(SERIAL_CMD_ISR_STATS, SERIAL_UNSUPPORTED, NULL);
+#endif
+    ExpectNoSerialReply();
+}
+
+/**
+ * The serial protocol end to end: resync after noise and a bad CRC, a frame split across chunks,
+ * SET_TIME with its error and BUSY replies, TELEMETRY and ISR_STATS.
+ */
+static void ScenarioSerial(void) {
+    SimSetRtcTime(9, 41, 30);
+    SimAt(SECONDS(1), PirHigh);
+    SimAt(SECONDS(2), SerialNoiseThenPing);
+    SimAt(SECONDS(2) + 100000, ExpectPingReply);
+    SimAt(SECONDS(3), SerialSetTimeFirstHalf);
+    SimAt(SECONDS(3) + 50000, SerialSetTimeSecondHalf);
+    SimAt(SECONDS(4), ExpectSerialTimeSet);
+    SimAt(SECONDS(5), SerialBadSetTimes);
+    SimAt(SECONDS(5) + 100000, ExpectBadSetTimeReplies);
+    SimAt(SECONDS(6), SerialSetTimeBehindFullQueue);
+    SimAt(SECONDS(6) + 100000, ExpectSetTimeBusy);
+    SimAt(SECONDS(6) + RTC_FLUSH_IDLE_MS * 1000 + 500000, ExpectRetriedTimeWrite);
+    SimAt(SECONDS(9), SerialTelemetry);
+    SimAt(SECONDS(9) + 100000, ExpectTelemetryReply);
+    SimAt(SECONDS(10), SerialIsrStats);
+    SimAt(SECONDS(10) + 100000, ExpectIsrStatsReplies);
+    SimRunFirmware(SECONDS(11));
+}
+#endif
+
+// Per multiplex slot, every change in the latched outputs. The ISR refresh switches frames at the
+// next slot after a publish and the DMA refresh at the next frame, so the two builds may see a change
+// up to a frame apart, but the changes must be the same. Only the chain's own outputs count: the shift
+// register model keeps the bits shifted past its end.
+#define FRAME_CHANGES_MAX 2048
+#define FRAME_PERIOD_US ((uint64_t)DISPLAY_SLOTS * SIM_MULTIPLEX_PERIOD_US)
+#define CHAIN_OUTPUTS_MASK ((1ULL << (DISPLAY_CHAIN_LENGTH * MAX6920_OUTPUTS)) - 1)
+
+typedef struct {
+    uint64_t time_us;
+    uint64_t outputs;
+} SlotChange;
+
+static SlotChange slot_changes[DISPLAY_SLOTS][FRAME_CHANGES_MAX];
+static uint32_t slot_change_count[DISPLAY_SLOTS];
+
+/**
+ * The slot a latch belongs to: the digit whose grid it drives, or the dots slot for anything else
+ * (which includes the all-off latch that blanks the display).
+ */
+static uint8_t LatchSlot(uint64_t outputs) {
+    for (uint8_t digit = 0; digit < DISPLAY_DIGITS; digit++) {
+        if (OutputOn(outputs, digit_grid_outputs[digit])) {
+            return digit;
+        }
+    }
+    return DOTS_SLOT;
+}
+
+static void RecordFrameLatch(uint64_t outputs) {
+    RecordLatch(outputs);
+    outputs &= CHAIN_OUTPUTS_MASK;
+
+    uint8_t slot = LatchSlot(outputs);
+    uint32_t count = slot_change_count[slot];
+    if (count != 0 && slot_changes[slot][count - 1].outputs == outputs) {
+        return;
+    }
+    if (count >= FRAME_CHANGES_MAX) {
+        SimFail("more than %u changes in slot %u", FRAME_CHANGES_MAX, slot);
+        return;
+    }
+    slot_changes[slot][count].time_us = sim_now_us;
+    slot_changes[slot][count].outputs = outputs;
+    slot_change_count[slot] = count + 1;
+}
+
+/**
+ * Compares the slot changes with a log written by another build.
+ */
+static void CompareFrameLog(FILE *reference) {
+    uint32_t index[DISPLAY_SLOTS] = {0};
+    unsigned slot;
+    unsigned long long time_us;
+    unsigned long long outputs;
+    uint32_t mismatches = 0;
+
+    while (fscanf(reference, "%u %llu %llx", &slot, &time_us, &outputs) == 3 && mismatches < 10) {
+        if (slot >= DISPLAY_SLOTS || index[slot] >= slot_change_count[slot]) {
+            SimFail("slot %u: reference change to %06llX at %llu us is missing", slot, outputs, time_us);
+            mismatches++;
+            continue;
+        }
+        const SlotChange *change = &slot_changes[slot][index[slot]++];
+        uint64_t apart = change->time_us > time_us ? change->time_us - time_us : time_us - change->time_us;
+        if (change->outputs != outputs || apart > FRAME_PERIOD_US) {
+            SimFail("slot %u: %06llX at %llu us, reference %06llX at %llu us", slot,
+                    (unsigned long long)change->outputs, (unsigned long long)change->time_us, outputs, time_us);
+            mismatches++;
+        }
+    }
+    for (slot = 0; slot < DISPLAY_SLOTS && mismatches == 0; slot++) {
+        if (index[slot] != slot_change_count[slot]) {
+            SimFail("slot %u: %u changes, reference %u", slot, (unsigned)slot_change_count[slot], (unsigned)index[slot]);
+        }
+    }
+}
+
+/**
+ * Runs a few minutes of clock use and logs every slot change: vfd_sim frames <log> [reference log].
+ * Boot, a brightness message, setting the time, the dots, the PIR timeout and a wake all publish frames.
+ */
+static void ScenarioFrames(void) {
+    if (scenario_arguments[0] == NULL) {
+        SimFail("frames needs a log file");
+        return;
+    }
+
+    SimOnLatch(RecordFrameLatch);
+    SimSetRtcTime(9, 41, 30);
+    SimAt(SECONDS(1), PirHigh);
+    SimAt(SECONDS(3), PressBrightness);
+    SimAt(SECONDS(3) + 100000, ReleaseBrightness);
+    SimAt(SECONDS(6), PressUp);
+    SimAt(SECONDS(6) + 100000, ReleaseUp);
+    SimAt(SECONDS(10), PirLow);
+    SimAt(SECONDS(200), PirHigh);
+    SimRunFirmware(SECONDS(210));
+
+    FILE *log = fopen(scenario_arguments[0], "w");
+    if (log == NULL) {
+        SimFail("cannot write %s", scenario_arguments[0]);
+        return;
+    }
+    uint32_t total = 0;
+    for (uint8_t slot = 0; slot < DISPLAY_SLOTS; slot++) {
+        for (uint32_t i = 0; i < slot_change_count[slot]; i++) {
+            fprintf(log, "%u %llu %06llX\n", slot, (unsigned long long)slot_changes[slot][i].time_us,
+                    (unsigned long long)slot_changes[slot][i].outputs);
+        }
+        total += slot_change_count[slot];
+    }
+    fclose(log);
+    printf("%u slot changes in %u latches\n", (unsigned)total, (unsigned)sim_stats.latches);
+
+    if (scenario_arguments[1] != NULL) {
+        FILE *reference = fopen(scenario_arguments[1], "r");
+        if (reference == NULL) {
+            SimFail("cannot read %s", scenario_arguments[1]);
+            return;
+        }
+        CompareFrameLog(reference);
+        fclose(reference);
+    }
+}
+
+static void MotionEverySevenMinutes(void) {
+    SimSetPir(1);
+    SimAt(sim_now_us + SECONDS(20), PirLow);
+    SimAt(sim_now_us + MINUTES(7), MotionEverySevenMinutes);
+}
+
+/**
+ * Runs a day with motion every few minutes and reports the host cost of the firmware.
+ */
+static void ScenarioBench(void) {
+    static const char *const names[SIM_IRQ_COUNT] = {"multiplex", "tick", "i2c", "pir", "uart"};
+    struct timespec start;
+    struct timespec end;
+
+    SimSetRtcTime(6, 0, 0);
+    SimAt(SECONDS(1), MotionEverySevenMinutes);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    SimRunFirmware(HOURS(24));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double host_s = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("24 h of clock time in %.2f s of host time (%.0fx)\n", host_s, 86400.0 / host_s);
+    for (uint8_t irq = 0; irq < SIM_IRQ_COUNT; irq++) {
+        const SimIsrStats *stats = &sim_stats.isr[irq];
+        if (stats->count != 0) {
+            printf("  isr %-9s %10u runs, mean %5.0f ns, max %7llu ns\n", names[irq], (unsigned)stats->count,
+                   (double)stats->total_ns / stats->count, (unsigned long long)stats->max_ns);
+        }
+    }
+    printf("  main loop  %10u passes, mean %5.0f ns, max %7llu ns\n", (unsigned)sim_stats.passes,
+           sim_stats.passes ? (double)sim_stats.pass_total_ns / sim_stats.passes : 0.0,
+           (unsigned long long)sim_stats.pass_max_ns);
+    printf("  wakes      %10u to the main loop, %u handler-only\n", (unsigned)sim_stats.wakes,
+           (unsigned)sim_stats.handler_wakes);
+    printf("  i2c        %10u transfers, %u bytes\n", (unsigned)sim_stats.i2c_transfers, (unsigned)sim_stats.i2c_bytes);
+    printf("  spi        %10u words, %u latches\n", (unsigned)sim_stats.spi_words, (unsigned)sim_stats.latches);
+}
+
+typedef struct {
+    const char *name;
+    void (*run)(void);
+} Scenario;
+
+static const Scenario scenarios[] = {
+    {"boot", ScenarioBoot},
+    {"day", ScenarioDay},
+    {"rtc_missing", ScenarioRtcMissing},
+    {"rtc_corrupt", ScenarioRtcCorrupt},
+    {"stuck_bus", ScenarioStuckBus},
+    {"set_time", ScenarioSetTime},
+    {"set_time_12h", ScenarioSetTime12Hour},
+    {"cpu_load", ScenarioCpuLoad},
+    {"pir_wake", ScenarioPirWake},
+    {"schedule_hold_at_boot", ScenarioScheduleHoldAtBoot},
+    {"schedule_step_back", ScenarioScheduleStepBack},
+    {"schedule_manual_brightness", ScenarioScheduleManualBrightness},
+    {"frames", ScenarioFrames},
+#if (SERIAL_PROTOCOL)
+    {"serial", ScenarioSerial},
+#endif
+#if (DISPLAY_TRACE)
+    {"display_trace", ScenarioDisplayTrace},
+#endif
+    {"bench", ScenarioBench},
+};
+
+int main(int argc, char **argv) {
+    if (argc >= 2) {
+        for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+            if (strcmp(argv[1], scenarios[i].name) == 0) {
+                scenario_arguments = &argv[2];
+                SimOnLatch(RecordLatch);
+                scenarios[i].run();
+                return SimFailures() ? 1 : 0;
+            }
+        }
+    }
+
+    fprintf(stderr, "usage: %s <scenario> [arguments]\nscenarios:", argv[0]);
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        fprintf(stderr, " %s", scenarios[i].name);
+    }
+    fputc('\n', stderr);
+    return 2;
+}
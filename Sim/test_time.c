@@ -0,0 +1,246 @@
+/******************************************************************************
+* File Name: test_time.c
+*
+* Description: Exhaustive host test of the DS1307 time conversions in main.c,
+* which is compiled in with the simulator's project.h:
+*
+*   - every second of the day survives EncodeTimeRegisters/DecodeTimeRegisters
+*     and matches a divide-by-ten reference encoding
+*   - all 60 BCD values and all 24 hours, in both register modes, decode to
+*     the right time, and every other register byte is rejected
+*   - AddToTimeOfDay wraps correctly in both directions
+*
+* With "bench" it also times the conversions and the render against the
+* divide-based code they replaced.
+*
+*******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// The functions under test and their constants come straight from the firmware
+#define main firmware_main
+#include "main.c"
+#undef main
+
+static int failures = 0;
+
+#define CHECK(condition, ...) \
+    do { \
+        if (!(condition)) { \
+            if (failures++ < 20) { \
+                printf("FAIL: " __VA_ARGS__); \
+                putchar('\n'); \
+            } \
+        } \
+    } while (0)
+
+// The divide-based conversions main.c used before the lookup tables, kept as the reference.
+// Not inlined, so the benchmark compares them on equal terms with the firmware's out-of-line calls.
+
+static uint8_t ReferenceBcd(uint32_t value) {
+    return (uint8_t)(((value / 10) << 4) | (value % 10));
+}
+
+__attribute__((noinline)) static void ReferenceEncode(uint32_t time, uint8_t *buffer) {
+    uint32_t hours = time / 3600;
+    uint32_t display_hours = (hours % 12 == 0) ? 12 : hours % 12;
+
+    buffer[0] = ReferenceBcd(time % 60);
+    buffer[1] = ReferenceBcd(time / 60 % 60);
+    buffer[2] = (uint8_t)(0x40 | ((hours >= 12) ? 0x20 : 0) | ReferenceBcd(display_hours));
+}
+
+__attribute__((noinline)) static uint32_t ReferenceDecode(const uint8_t *buffer) {
+    uint32_t seconds = (buffer[0] & 0x0F) + ((buffer[0] >> 4) & 0x07) * 10;
+    uint32_t minutes = (buffer[1] & 0x0F) + (buffer[1] >> 4) * 10;
+    uint32_t hours;
+
+    if (buffer[2] & 0x40) {
+        hours = (buffer[2] & 0x0F) + ((buffer[2] >> 4) & 0x01) * 10;
+        hours = hours % 12 + ((buffer[2] & 0x20) ? 12 : 0);
+    } else {
+        hours = (buffer[2] & 0x0F) + ((buffer[2] >> 4) & 0x03) * 10;
+    }
+    return hours * 3600 + minutes * 60 + seconds;
+}
+
+__attribute__((noinline)) static void ReferenceDigits(uint32_t time, uint8_t *digits) {
+    uint32_t hours = time / 3600;
+    uint32_t minutes = time / 60 % 60;
+    uint32_t display_hours = (hours == 0) ? 12 : (hours > 12) ? hours - 12 : hours;
+
+    digits[0] = (uint8_t)(display_hours / 10);
+    digits[1] = (uint8_t)(display_hours % 10);
+    digits[2] = (uint8_t)(minutes / 10);
+    digits[3] = (uint8_t)(minutes % 10);
+}
+
+static uint8_t IsDecimalBcd(uint8_t bcd, uint8_t max) {
+    return (bcd & 0x0F) <= 9 && (bcd >> 4) <= 9 && ((bcd >> 4) * 10 + (bcd & 0x0F)) <= max;
+}
+
+static void TestEveryTimeOfDay(void) {
+    for (uint32_t time = 0; time < SECONDS_PER_DAY; time++) {
+        uint8_t encoded[3];
+        uint8_t expected[3];
+
+        EncodeTimeRegisters(time, encoded);
+        ReferenceEncode(time, expected);
+        CHECK(memcmp(encoded, expected, 3) == 0, "encode %u: %02X %02X %02X, expected %02X %02X %02X", (unsigned)time,
+              encoded[0], encoded[1], encoded[2], expected[0], expected[1], expected[2]);
+        CHECK(DecodeTimeRegisters(encoded) == time, "decode of encoded %u gives %u", (unsigned)time,
+              (unsigned)DecodeTimeRegisters(encoded));
+    }
+}
+
+static void TestEveryBcdValue(void) {
+    for (uint32_t value = 0; value < 256; value++) {
+        uint8_t bcd = (uint8_t)value;
+        uint8_t valid = IsDecimalBcd(bcd, 59);
+
+        if (valid) {
+            CHECK(BcdToBinary(bcd) == (bcd >> 4) * 10 + (bcd & 0x0F), "BcdToBinary(%02X) = %u", bcd, BcdToBinary(bcd));
+        }
+
+        // Seconds, with and without the CH bit, then minutes
+        uint8_t seconds[3] = {bcd, 0x00, 0x00};
+        uint8_t halted[3] = {(uint8_t)(bcd | 0x80), 0x00, 0x00};
+        uint8_t minutes[3] = {0x00, bcd, 0x00};
+        if (bcd < 0x80) {
+            uint32_t expected = valid ? ReferenceDecode(seconds) : TIME_INVALID;
+            CHECK(DecodeTimeRegisters(seconds) == expected, "seconds %02X decode to %u", bcd,
+                  (unsigned)DecodeTimeRegisters(seconds));
+            CHECK(DecodeTimeRegisters(halted) == expected, "halted seconds %02X decode to %u", bcd,
+                  (unsigned)DecodeTimeRegisters(halted));
+            expected = valid ? ReferenceDecode(minutes) : TIME_INVALID;
+            CHECK(DecodeTimeRegisters(minutes) == expected, "minutes %02X decode to %u", bcd,
+                  (unsigned)DecodeTimeRegisters(minutes));
+        }
+    }
+}
+
+static void TestEveryHourRegister(void) {
+    uint8_t valid_24h = 0;
+    uint8_t valid_12h = 0;
+
+    for (uint32_t value = 0; value < 128; value++) {
+        uint8_t registers[3] = {0x30, 0x15, (uint8_t)value};
+        uint32_t decoded = DecodeTimeRegisters(registers);
+        uint32_t expected = TIME_INVALID;
+
+        if (value & 0x40) {
+            uint8_t hour_bcd = value & 0x1F;
+            if (hour_bcd != 0 && IsDecimalBcd(hour_bcd, 12)) {
+                expected = ReferenceDecode(registers);
+                valid_12h++;
+            }
+        } else if (IsDecimalBcd(value & 0x3F, 23)) {
+            expected = ReferenceDecode(registers);
+            valid_24h++;
+        }
+        CHECK(decoded == expected, "hour register %02X decodes to %u, expected %u", (unsigned)value,
+              (unsigned)decoded, (unsigned)expected);
+        CHECK(decoded <= TIME_INVALID, "hour register %02X decodes past the day", (unsigned)value);
+    }
+
+    // Each mode reaches every hour exactly once (12h: 1-12 AM and PM)
+    CHECK(valid_24h == 24, "%u valid 24-hour registers", valid_24h);
+    CHECK(valid_12h == 24, "%u valid 12-hour registers", valid_12h);
+    for (uint32_t hour = 0; hour < 24; hour++) {
+        uint8_t hour_24h[3] = {0x00, 0x00, ReferenceBcd(hour)};
+        CHECK(DecodeTimeRegisters(hour_24h) == hour * 3600, "24-hour %u", (unsigned)hour);
+    }
+}
+
+static void TestAddToTimeOfDay(void) {
+    static const int32_t deltas[] = {1, -1, 60, -60, 300, -300, 3600, -3600, 86399, -86399, 86400, -86400, 200000,
+                                     -200000};
+
+    for (uint32_t time = 0; time < SECONDS_PER_DAY; time++) {
+        for (size_t i = 0; i < sizeof(deltas) / sizeof(deltas[0]); i++) {
+            int64_t expected = ((int64_t)time + deltas[i]) % (int64_t)SECONDS_PER_DAY; // The firmware's is unsigned
+            if (expected < 0) {
+                expected += SECONDS_PER_DAY;
+            }
+            CHECK(AddToTimeOfDay(time, deltas[i]) == (uint32_t)expected, "AddToTimeOfDay(%u, %d) = %u", (unsigned)time,
+                  (int)deltas[i], (unsigned)AddToTimeOfDay(time, deltas[i]));
+        }
+    }
+}
+
+// Benchmark
+
+static volatile uint32_t sink;
+
+static inline uint64_t Ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+#define BENCH_PASSES 20
+
+/**
+ * Times one pass over the whole day and reports the cost per call, best of a few passes.
+ */
+#define BENCH(label, body) \
+    do { \
+        uint64_t best = UINT64_MAX; \
+        for (int pass = 0; pass < BENCH_PASSES; pass++) { \
+            uint64_t start = Ticks(); \
+            for (uint32_t time = 0; time < SECONDS_PER_DAY; time++) { \
+                body; \
+            } \
+            uint64_t elapsed = Ticks() - start; \
+            if (elapsed < best) { \
+                best = elapsed; \
+            } \
+        } \
+        printf("  %-32s %6.1f\n", label, (double)best / SECONDS_PER_DAY); \
+    } while (0)
+
+static void Bench(void) {
+    uint8_t buffer[3];
+    uint8_t digits[4];
+    static uint8_t encoded[SECONDS_PER_DAY][3];
+
+    for (uint32_t time = 0; time < SECONDS_PER_DAY; time++) {
+        EncodeTimeRegisters(time, encoded[time]);
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    printf("TSC ticks per call, best of %d passes over the day\n", BENCH_PASSES);
+#else
+    printf("ns per call, best of %d passes over the day\n", BENCH_PASSES);
+#endif
+    BENCH("encode, divide (before)", (ReferenceEncode(time, buffer), sink = buffer[2]));
+    BENCH("encode, tables (after)", (EncodeTimeRegisters(time, buffer), sink = buffer[2]));
+    BENCH("decode, multiply (before)", sink = ReferenceDecode(encoded[time]));
+    BENCH("decode, shifts + check (after)", sink = DecodeTimeRegisters(encoded[time]));
+    BENCH("digits, divide (before)", (ReferenceDigits(time, digits), sink = digits[3]));
+    BENCH("render, whole frame (after)", (SetTimeOfDay(time), MarkDisplayDirty(DIRTY_DIGITS), UpdateDisplayTime()));
+}
+
+int main(int argc, char **argv) {
+    TestEveryTimeOfDay();
+    TestEveryBcdValue();
+    TestEveryHourRegister();
+    TestAddToTimeOfDay();
+
+    if (argc == 2 && strcmp(argv[1], "bench") == 0) {
+        Bench();
+    }
+
+    if (failures != 0) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("time conversions: all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,25 @@
+/* ========================================
+ *
+ * Copyright YOUR COMPANY, THE YEAR
+ * All Rights Reserved
+ * UNPUBLISHED, LICENSED SOFTWARE.
+ *
+ * CONFIDENTIAL AND PROPRIETARY INFORMATION
+ * WHICH IS THE PROPERTY OF your company.
+ *
+ * ========================================
+*/
+#ifndef CYAPICALLBACKS_H
+#define CYAPICALLBACKS_H
+    
+
+    /*Define your macro callbacks here */
+    /*For more information, refer to the Writing Code topic in the PSoC Creator Help.*/
+
+    /* Advance the DS1307 transaction engine in main.c from the I2C_1 interrupt */
+    #define I2C_1_ISR_EXIT_CALLBACK
+    void I2C_1_ISR_ExitCallback(void);
+
+    
+#endif /* CYAPICALLBACKS_H */   
+/* [] */
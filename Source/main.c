@@ -45,40 +45,319 @@
 
 // Function prototypes
 void UpdateDisplayTime(void);
+void MarkDisplayDirty(uint8_t flags);
 void DisplayMultiplexed(uint8_t position);
+void BlankDisplay(void);
+void WakeDisplay(void);
 void MultiplexDisplay(void);
+void InitializeDisplayDMA(void);
 void ReadTimeFromDS1307(void);
-void WriteTimeToDS1307(void);
-void InitializeDS1307(uint8_t *initialized);
+uint8_t WriteTimeToDS1307(void);
+void MarkTimeChanged(void);
+void FlushTimeToDS1307(void);
+void InitializeDS1307(void);
+uint32_t DecodeTimeRegisters(const uint8_t *buffer);
+void EncodeTimeRegisters(uint32_t time, uint8_t *buffer);
+uint32_t AddToTimeOfDay(uint32_t time, int32_t delta_s);
+void SetTimeOfDay(uint32_t time);
+uint8_t BcdToBinary(uint8_t bcd);
+uint8_t IsBcdInRange(uint8_t bcd, uint8_t max);
+void EncodeSettings(uint8_t *block);
+uint8_t DecodeSettings(const uint8_t *block);
+void MarkSettingsChanged(void);
+void FlushSettingsToDS1307(void);
+void StartNextDS1307Request(void);
+void FinishDS1307Request(uint8_t status);
+void AdvanceDS1307Transaction(void);
+void RecordDS1307Result(uint8_t status);
+void AbortDS1307Request(void);
+void RecoverI2CBus(void);
+void I2C_1_ISR_ExitCallback(void);
+void AdvanceSecond(void);
+void PostEvent(uint16_t events);
+void RegisterTask(void (*run)(void), uint32_t period_ms, uint16_t events);
+void RunScheduler(void);
+void StartCycleCounter(void);
+void FadeTask(void);
+void StartFade(uint8_t level);
+uint16_t EaseFade(uint16_t progress);
+void DisplayTask(void);
+void ButtonTask(void);
+void RtcTask(void);
 void CheckPIRSensor(void);
+void WakeDisplayOnMotion(void);
+void OccupancyTask(void);
+void ScheduleTask(void);
+void RescanSchedule(uint16_t now);
+void RunScheduledActions(uint16_t now);
+void RestoreScheduledLevels(uint16_t from, uint16_t now);
+uint8_t ScheduleEntrySkipped(uint8_t action, uint16_t from, uint16_t now);
+void SetDisplayHold(uint8_t hold);
+void SetScheduledBrightness(uint8_t level);
+void ScheduleReadComplete(uint8_t status, const uint8_t *data);
+void SampleButtons(void);
+void PushInputEvent(uint8_t button, uint8_t kind, uint8_t step);
+void InputTask(void);
+void HandleBrightnessPress(void);
+void HandleTimeButtonPress(uint8_t button);
+void HandleTimeButtonRepeat(uint8_t button, uint8_t step);
+void HandleTimeButtonRelease(uint8_t button);
+void AdjustMinutes(uint8_t button, uint8_t amount);
+uint8_t GlyphSegments(char c);
+void ShowMessage(const char *text, uint16_t duration_ms);
+void AdvanceMessage(void);
+void ClearMessage(void);
 
-// Segment patterns for digits 0-9 (A, B, C, D, E, F, G), not inverted
-static const uint8_t segment_patterns[10] = {
-    0x3F, // 0
-    0x06, // 1
-    0x5B, // 2
-    0x4F, // 3
-    0x66, // 4
-    0x6D, // 5
-    0x7D, // 6
-    0x07, // 7
-    0x7F, // 8
-    0x6F  // 9
+// Binary 0-59 to packed BCD, so the DS1307 encode and the digit render need no division
+static const uint8_t bcd_from_binary[60] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19,
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+    0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59
 };
 
+// 24-hour clock to the 12-hour value shown and written to the DS1307
+static const uint8_t hour12_from_hour24[24] = {
+    12, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+    12, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
+};
+
+// Segment patterns for printable ASCII 0x20-0x7F (bit 0 = A ... bit 6 = G), not inverted.
+// Every letter has a pattern: those seven segments cannot draw are approximated (K, M, W; V as U,
+// X as H). Symbols without a usable shape are blank. Cases share a glyph unless the lowercase one differs.
+#define GLYPH_FIRST ' '
+#define GLYPH_COUNT 96
+static const uint8_t glyph_segments[GLYPH_COUNT] = {
+    0x00, 0x0A, 0x22, 0x00, 0x00, 0x00, 0x00, 0x20, // space !"#$%&'
+    0x39, 0x0F, 0x00, 0x00, 0x10, 0x40, 0x00, 0x52, // ()*+,-./
+    0x3F, 0x06, 0x5B, 0x4F, 0x66, 0x6D, 0x7D, 0x07, // 01234567
+    0x7F, 0x6F, 0x00, 0x00, 0x58, 0x48, 0x4C, 0x53, // 89:;<=>?
+    0x00, 0x77, 0x7C, 0x39, 0x5E, 0x79, 0x71, 0x3D, // @ABCDEFG
+    0x76, 0x30, 0x1E, 0x75, 0x38, 0x37, 0x54, 0x3F, // HIJKLMNO
+    0x73, 0x67, 0x50, 0x6D, 0x78, 0x3E, 0x3E, 0x7E, // PQRSTUVW
+    0x76, 0x6E, 0x5B, 0x39, 0x64, 0x0F, 0x23, 0x08, // XYZ[\]^_
+    0x00, 0x77, 0x7C, 0x58, 0x5E, 0x79, 0x71, 0x6F, // `abcdefg
+    0x74, 0x10, 0x1E, 0x75, 0x38, 0x37, 0x54, 0x5C, // hijklmno
+    0x73, 0x67, 0x50, 0x6D, 0x78, 0x1C, 0x3E, 0x7E, // pqrstuvw
+    0x76, 0x6E, 0x5B, 0x00, 0x30, 0x00, 0x00, 0x00  // xyz{|}~
+};
+
+// Display refresh mode: 0 = Timer_1 ISR shifts out each slot, 1 = DMA_Refresh streams the frame.
+// DMA mode needs a DMA component named DMA_Refresh with its drq wired to Timer_1's tc, and
+// Pin_LOAD driven from SPIM_1's ss output in TopDesign so the latch strobe comes from hardware.
+#ifndef DISPLAY_REFRESH_DMA
+#define DISPLAY_REFRESH_DMA 0
+#endif
+
+// ISR profiling: entry/exit timestamps from the DWT cycle counter. 0 compiles it out entirely.
+#ifndef ISR_PROFILING
+#define ISR_PROFILING 0
+#endif
+
+#if (ISR_PROFILING)
+#define ISR_ID_MULTIPLEX 0
+#define ISR_ID_TICK 1 // Includes the button sampling
+#define ISR_PROFILE_COUNT 2
+#define ISR_HISTOGRAM_BUCKETS 12 // Bucket n counts durations below 2^(n + 4) cycles; the last one is open-ended
+#define ISR_TRACE_DEPTH 32       // Recent samples kept in the ring buffer (power of two)
+
+typedef struct {
+    uint32_t count;
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+    uint64_t total_cycles;  // Mean = total_cycles / count
+    uint32_t last_entry;    // Entry timestamp of the previous run
+    uint32_t min_period;    // Entry-to-entry interval, for jitter
+    uint32_t max_period;
+    uint32_t histogram[ISR_HISTOGRAM_BUCKETS];
+} IsrProfile;
+
+typedef struct {
+    uint8_t id;
+    uint32_t entry;
+    uint32_t cycles;
+} IsrTraceSample;
+
+static volatile IsrProfile isr_profiles[ISR_PROFILE_COUNT];
+static volatile IsrTraceSample isr_trace[ISR_TRACE_DEPTH];
+static volatile uint8_t isr_trace_head = 0;
+
+void RecordIsrProfile(uint8_t id, uint32_t entry);
+uint8_t ReadIsrProfile(uint8_t id, IsrProfile *snapshot);
+
+#define ISR_PROFILE_ENTER(id) uint32_t isr_profile_entry = DWT->CYCCNT
+#define ISR_PROFILE_EXIT(id) RecordIsrProfile((id), isr_profile_entry)
+#else
+#define ISR_PROFILE_ENTER(id)
+#define ISR_PROFILE_EXIT(id)
+#endif
+
 // DS1307 I2C address
 #define DS1307_ADDRESS 0x68 // 7-bit address (1101000)
 
-// Array to store the four digits to display (0-9)
-static volatile uint8_t display_digits[4] = {0, 0, 0, 0};
+// DS1307 transaction engine states
+#define DS1307_IDLE 0
+#define DS1307_SET_POINTER 1 // Register pointer write, followed by a repeated-start read
+#define DS1307_READING 2
+#define DS1307_WRITING 3
+
+// DS1307 request queue
+#define DS1307_QUEUE_SIZE 4 // Must be a power of two
+#define DS1307_MAX_DATA 24 // Largest transfer: the occupancy block
+
+// Completion statuses outside the I2C_1_MSTAT_ERR bits (which all sit in the high nibble)
+#define DS1307_ERR_REFUSED 0x01 // Circuit breaker open, nothing went on the bus
+#define DS1307_ERR_TIMEOUT 0x02 // Transaction watchdog expired
+#define DS1307_ERR_BUSY 0x03 // Queue full, nothing was queued
+
+// Completion callback, run from the I2C_1 ISR (or from the poster when not queued). status is 0 on success,
+// otherwise the I2C_1_MSTAT_ERR bits or a DS1307_ERR code.
+typedef void (*DS1307Callback)(uint8_t status, const uint8_t *data);
+
+typedef struct {
+    uint8_t write;                       // 1 = write, 0 = read
+    uint8_t length;                      // Number of data bytes
+    uint8_t buffer[DS1307_MAX_DATA + 1]; // Register address followed by the data bytes
+    DS1307Callback done;                 // May be NULL
+} DS1307Request;
+
+static DS1307Request ds1307_queue[DS1307_QUEUE_SIZE];
+static volatile uint8_t ds1307_queue_head = 0; // Request in progress (or next to start)
+static volatile uint8_t ds1307_queue_count = 0;
+static volatile uint8_t ds1307_state = DS1307_IDLE;
+
+uint8_t PostDS1307Request(uint8_t write, uint8_t reg, const uint8_t *data, uint8_t length, DS1307Callback done);
+void InitReadComplete(uint8_t status, const uint8_t *data);
+void SettingsWriteComplete(uint8_t status, const uint8_t *data);
+void OccupancyReadComplete(uint8_t status, const uint8_t *data);
+void TimeReadComplete(uint8_t status, const uint8_t *data);
+void TimeWriteComplete(uint8_t status, const uint8_t *data);
+
+// Display geometry, chosen at compile time. MAX6920 outputs are numbered chip * 12 + bit, where
+// chip 0 is the first in the chain after SPIM_1 and so receives the last word shifted out.
+#ifndef DISPLAY_DIGITS
+#define DISPLAY_DIGITS 4         // 4 = HH:MM, 6 = HH:MM:SS
+#endif
+#ifndef DISPLAY_CHAIN_LENGTH
+#define DISPLAY_CHAIN_LENGTH 2   // Daisy-chained MAX6920s
+#endif
+#define MAX6920_OUTPUTS 12       // SPIM_1 is 12 bits wide, so each chip takes exactly one word
+#if (DISPLAY_CHAIN_LENGTH < 2)
+#error "The output map below reaches output 15, so the chain needs at least two MAX6920s"
+#endif
+#define DISPLAY_SHOWS_SECONDS (DISPLAY_DIGITS >= 6)
+
+// Multiplex slots: the digits plus the dots
+#define DISPLAY_SLOTS (DISPLAY_DIGITS + 1)
+#define DOTS_SLOT DISPLAY_DIGITS
+
+static const uint8_t segment_outputs[7] = {0, 1, 2, 3, 4, 5, 6}; // Segments A-G, shared by all digits
+// One grid per digit, left to right
+#if (DISPLAY_DIGITS == 4)
+static const uint8_t digit_grid_outputs[] = {7, 8, 9, 10};
+#elif (DISPLAY_DIGITS == 6)
+static const uint8_t digit_grid_outputs[] = {7, 8, 9, 10, 11, 15};
+#else
+#error "DISPLAY_DIGITS must be 4 or 6"
+#endif
+_Static_assert(sizeof(digit_grid_outputs) == DISPLAY_DIGITS, "digit_grid_outputs needs one grid per digit");
+static const uint8_t digit_slot_outputs[] = {12};   // Held on during every digit slot
+static const uint8_t dots_outputs[] = {12, 13, 14}; // Lit in the dots slot while dots_on
+
+// One multiplex slot in shift order: words[0] goes out first and ends up in the last chip
+typedef struct {
+    uint16_t words[DISPLAY_CHAIN_LENGTH];
+} DisplayFrameSlot;
+
+static const DisplayFrameSlot blank_slot; // All outputs off
+
+void LatchDisplaySlot(const volatile DisplayFrameSlot *slot);
+void SetDisplayOutput(volatile DisplayFrameSlot *slot, uint8_t output);
+
+// Double-buffered, pre-encoded frames. The multiplex ISR only reads frame_buffers[front_buffer].
+static volatile DisplayFrameSlot frame_buffers[2][DISPLAY_SLOTS];
+static volatile uint8_t front_buffer = 0;
 static volatile uint8_t current_digit = 0;
 
-// Time variables (read from DS1307)
-static volatile uint8_t hours = 0;   // 0-23 (internal 24-hour format)
-static volatile uint8_t minutes = 0; // 0-59
-static volatile uint8_t seconds = 0; // 0-59
+#if (DISPLAY_REFRESH_DMA)
+// One circular TD chain per frame buffer; each Timer_1 request moves one slot into the SPIM_1 FIFO
+#define DMA_REFRESH_BURST_BYTES 2 // One 16-bit FIFO word per burst
+static uint8_t dma_refresh_channel;
+static uint8_t dma_refresh_tds[2][DISPLAY_SLOTS];
+#endif
+
+// Display trace: every slot latched by the CPU, with its DWT timestamp, and an analyzer for what
+// the tube actually sees. The DMA refresh latches in hardware and is not traced. 0 compiles it out.
+#ifndef DISPLAY_TRACE
+#define DISPLAY_TRACE 0
+#endif
+
+#if (DISPLAY_TRACE)
+#define DISPLAY_TRACE_DEPTH 256            // Power of two, about 50 frames with five slots
+#define DISPLAY_GRIDS (DISPLAY_DIGITS + 1) // Digit grids, then the dots
+
+typedef struct {
+    uint32_t timestamp; // DWT->CYCCNT after the latch
+    DisplayFrameSlot slot;
+} DisplayTraceSample;
+
+typedef struct {
+    uint32_t span_cycles;                      // Time covered by the analysed samples
+    uint32_t refresh_millihz;                  // Lit periods of the first grid per second, x1000
+    uint32_t on_cycles[DISPLAY_GRIDS];         // Total lit time per grid
+    uint16_t duty_permille[DISPLAY_GRIDS];
+    uint32_t worst_gap_cycles[DISPLAY_GRIDS];  // Longest dark interval between two lit slots
+    uint16_t flicker_permille[DISPLAY_GRIDS];  // (max - min) / (max + min) of the lit-to-lit period
+} DisplayTraceReport;
+
+static volatile DisplayTraceSample display_trace[DISPLAY_TRACE_DEPTH];
+static volatile uint32_t display_trace_head = 0;  // Free-running
+static volatile uint8_t display_trace_frozen = 0; // Recording is paused while the analyzer runs
+
+void RecordDisplayTrace(const volatile DisplayFrameSlot *slot);
+uint8_t TestDisplayOutput(const volatile DisplayFrameSlot *slot, uint8_t output);
+uint8_t AnalyzeDisplayTrace(DisplayTraceReport *report);
+#endif
+
+// Time of day as one word, kept by the tick ISR and resynced from the DS1307. An aligned 32-bit
+// load is single-copy atomic on the Cortex-M3, so one read gives a consistent hour/minute/second.
+// Writers outside the tick ISR read-modify-write it, so they mask interrupts.
+#define SECONDS_PER_DAY 86400UL
+#define TIME_OF_DAY(h, m, s) ((uint32_t)(h) * 3600 + (uint32_t)(m) * 60 + (s))
+#define TIME_INVALID SECONDS_PER_DAY // DecodeTimeRegisters result for registers that are not a time
+static volatile uint32_t time_of_day = 0; // Seconds since midnight, 0-86399
+static volatile uint16_t millis_in_second = 0; // 0-999
 static volatile uint8_t dots_on = 1; // 1 = dots on, 0 = dots off
 
+// What changed on the display since the last render
+#define DIRTY_DIGITS (1 << 0) // Hour or minute changed
+#define DIRTY_DOTS   (1 << 1) // Dots toggled
+static volatile uint8_t display_dirty = 0;
+
+// Render counters
+typedef struct {
+    uint32_t full_renders;       // Digits re-encoded
+    uint32_t dots_renders;       // Only the dots slot changed, digit slots copied from the front frame
+    uint32_t avoided_renders;    // Seconds that passed without a visible change
+    uint32_t pwm_writes_avoided; // Fade steps that did not change the duty cycle
+} RenderStats;
+static volatile RenderStats render_stats = {0, 0, 0, 0};
+
+// Software clock resync with the DS1307
+#define RTC_RESYNC_INTERVAL_MS (60UL * 60 * 1000) // Hourly
+
+// Drift of the software clock, sampled at each resync (RTC minus software time)
+typedef struct {
+    uint32_t resync_count;
+    int32_t last_drift_s;
+    int32_t min_drift_s;
+    int32_t max_drift_s;
+    int32_t total_drift_s;
+} RtcDriftStats;
+static volatile RtcDriftStats rtc_drift = {0, 0, 0, 0, 0};
+
 // Brightness control variables
 #define BRIGHTNESS_LEVELS 6
 static const uint8_t brightness_values[BRIGHTNESS_LEVELS] = {
@@ -89,606 +368,2717 @@ static const uint8_t brightness_values[BRIGHTNESS_LEVELS] = {
     204, // Level 4: 80% brightness
     255  // Level 5: 100% brightness
 };
+// Perceptual lightness of each level (inverse gamma of brightness_values); fades interpolate in this space
+static const uint8_t brightness_lightness[BRIGHTNESS_LEVELS] = {90, 123, 168, 202, 230, 255};
+
+// Lightness to PWM duty cycle, gamma 2.2: round(255 * (i / 255)^2.2)
+static const uint8_t gamma_table[256] = {
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   2,
+      3,   3,   3,   3,   3,   4,   4,   4,   4,   5,   5,   5,   5,   6,   6,   6,
+      6,   7,   7,   7,   8,   8,   8,   9,   9,   9,  10,  10,  11,  11,  11,  12,
+     12,  13,  13,  13,  14,  14,  15,  15,  16,  16,  17,  17,  18,  18,  19,  19,
+     20,  20,  21,  22,  22,  23,  23,  24,  25,  25,  26,  26,  27,  28,  28,  29,
+     30,  30,  31,  32,  33,  33,  34,  35,  35,  36,  37,  38,  39,  39,  40,  41,
+     42,  43,  43,  44,  45,  46,  47,  48,  49,  49,  50,  51,  52,  53,  54,  55,
+     56,  57,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,  68,  69,  70,  71,
+     73,  74,  75,  76,  77,  78,  79,  81,  82,  83,  84,  85,  87,  88,  89,  90,
+     91,  93,  94,  95,  97,  98,  99, 100, 102, 103, 105, 106, 107, 109, 110, 111,
+    113, 114, 116, 117, 119, 120, 121, 123, 124, 126, 127, 129, 130, 132, 133, 135,
+    137, 138, 140, 141, 143, 145, 146, 148, 149, 151, 153, 154, 156, 158, 159, 161,
+    163, 165, 166, 168, 170, 172, 173, 175, 177, 179, 181, 182, 184, 186, 188, 190,
+    192, 194, 196, 197, 199, 201, 203, 205, 207, 209, 211, 213, 215, 217, 219, 221,
+    223, 225, 227, 229, 231, 234, 236, 238, 240, 242, 244, 246, 248, 251, 253, 255
+};
+
 static volatile uint8_t brightness_level = 0; // Start at lowest brightness (Level 0)
 static volatile uint16_t current_brightness = 26; // Current PWM duty cycle (start at level 0)
 static volatile uint16_t target_brightness = 26; // Target PWM duty cycle
-static volatile uint16_t start_brightness = 26; // Starting brightness for the fade
+static volatile uint8_t current_lightness = 90; // Current perceptual lightness
+static volatile uint8_t start_lightness = 90; // Lightness at the start of the fade
+static volatile uint8_t target_lightness = 90; // Lightness at the end of the fade
 static volatile uint8_t fading = 0; // 1 if fading is in progress, 0 otherwise
 static volatile uint32_t fade_start_time = 0; // Start time of the fade
-#define FADE_DURATION_MS 200 // Fade duration in milliseconds
+static volatile uint32_t fade_rate_q16 = 0; // Fade progress per millisecond (Q16)
+#define FADE_DURATION_MS 200 // Default fade duration in milliseconds
 #define FADE_STEP_MS 10 // Update brightness every 10ms
 
+// Fade easing curves
+#define FADE_CURVE_LINEAR 0
+#define FADE_CURVE_EASE_OUT 1    // Fast start, slow finish
+#define FADE_CURVE_EASE_IN_OUT 2 // Smoothstep
+static uint16_t fade_duration_ms = FADE_DURATION_MS;
+static uint8_t fade_curve = FADE_CURVE_EASE_IN_OUT;
+
 // Display control variables for PIR detection
 static volatile uint8_t display_on = 0; // 0 = display off, 1 = display on
-static volatile uint32_t display_timeout = 0; // Timestamp when display should turn off
 #define DISPLAY_TIMEOUT_MS (3 * 60 * 1000) // 5 minutes in milliseconds (changed from 10 seconds)
+static uint32_t display_timeout_ms = DISPLAY_TIMEOUT_MS;
+static volatile uint8_t pir_seen = 0; // Motion since OccupancyTask last looked
+
+// PIR wake source: 0 = CheckPIRSensor polls Pin_PIR every 100 ms, 1 = an isr_PIR edge interrupt
+// wakes the display at once, with the poll kept as a backstop. Interrupt mode needs isr_PIR on
+// Pin_PIR's interrupt terminal (rising edge) in TopDesign, which the shipped design does not have.
+#ifndef PIR_INTERRUPT
+#define PIR_INTERRUPT 0
+#endif
+
+// Occupancy per hour of day, for tuning the display timeout from real usage
+typedef struct {
+    uint16_t active_minutes; // Minutes with motion
+    uint16_t wakes;          // Times the PIR woke the display
+} OccupancyHour;
+static volatile OccupancyHour occupancy[24];
+
+// Optional copy in DS1307 NVRAM: per hour, a running average of active minutes (0-60)
+#ifndef OCCUPANCY_NVRAM
+#define OCCUPANCY_NVRAM 1
+#endif
+#define NVRAM_OCCUPANCY_ADDRESS 0x10
+static uint8_t occupancy_average[24];
+static uint8_t occupancy_minute = 0xFF; // Minute last accounted, 0xFF = not started
+static uint8_t occupancy_hour = 0;
+static uint8_t occupancy_this_hour = 0; // Active minutes so far in occupancy_hour
+static uint32_t occupancy_unsaved = 0; // Bit per hour whose average is not yet queued for NVRAM
 
 // Time-setting mode variables
 static volatile uint8_t time_setting_mode = 0; // 0 = normal, 1 = setting time
-static volatile uint32_t button_press_start = 0; // Timestamp of button press (in ms)
 static volatile uint8_t button_pressed = 0; // 0 = none, 1 = UP, 2 = DOWN
-static volatile uint8_t adjustment_speed = 0; // 0 = single, 1 = moderate, 2 = fast
-static volatile uint32_t last_button_activity = 0; // Timestamp of last button activity (in ms)
+#define TIME_SETTING_TIMEOUT_MS 5000 // Leave time-setting mode after this long without button activity
 
 // Millisecond counter for timing
 static volatile uint32_t tick_count = 0;
 
-// I2C error flag
+// Buttons, sampled from the 1 ms tick. The IDs double as button_pressed values for UP and DOWN.
+#define BUTTON_BRIGHTNESS 0
+#define BUTTON_UP 1
+#define BUTTON_DOWN 2
+#define BUTTON_COUNT 3
+#define BUTTON_INTEGRATOR_MAX 20 // Consistent 1 ms samples needed to change state
+
+// Input event kinds
+#define INPUT_PRESS 0
+#define INPUT_RELEASE 1
+#define INPUT_REPEAT 2     // Auto-repeat while held, step taken from the acceleration curve
+#define INPUT_LONG_PRESS 3 // Held for long_press_ms, sent once per press
+
+// One stage of an acceleration curve: from hold_ms on, repeat every repeat_ms with the given step
+typedef struct {
+    uint16_t hold_ms;
+    uint16_t repeat_ms;
+    uint8_t step;
+} RepeatStage;
+
+typedef struct {
+    const RepeatStage *curve; // NULL = no auto-repeat
+    uint8_t stages;
+    uint16_t long_press_ms;   // 0 = no long-press event
+} ButtonConfig;
+
+// Time setting: 1 minute every 250 ms after 500 ms, 5 minutes every 250 ms after 2 s
+static const RepeatStage time_adjust_curve[] = {
+    {500, 250, 1},
+    {2000, 250, 5}
+};
+
+static const ButtonConfig button_config[BUTTON_COUNT] = {
+    {NULL, 0, 0},              // Brightness: one step per press
+    {time_adjust_curve, 2, 0}, // UP
+    {time_adjust_curve, 2, 0}  // DOWN
+};
+
+// Sampler state, owned by the tick ISR
+typedef struct {
+    uint8_t integrator; // 0 = settled released, BUTTON_INTEGRATOR_MAX = settled pressed
+    uint8_t pressed;
+    uint8_t stage;      // Acceleration stages entered so far
+    uint8_t long_sent;
+    uint32_t press_time;
+    uint32_t next_repeat;
+} ButtonState;
+static ButtonState button_states[BUTTON_COUNT];
+
+#define INPUT_QUEUE_SIZE 16 // Power of two, at most 128 with the 8-bit free-running indices
+
+typedef struct {
+    uint8_t button;
+    uint8_t kind;
+    uint8_t step;       // Repeat step, 0 for the other kinds
+    uint32_t timestamp; // tick_count when the event was detected
+} InputEvent;
+
+// Lock-free single-producer/single-consumer ring from the tick ISR to InputTask
+static volatile InputEvent input_queue[INPUT_QUEUE_SIZE];
+static volatile uint8_t input_queue_head = 0; // Written only by the producer
+static volatile uint8_t input_queue_tail = 0; // Written only by the consumer
+
+typedef struct {
+    uint32_t pushed;
+    uint32_t consumed;
+    uint32_t dropped;   // Queue was full
+    uint8_t high_water; // Deepest backlog seen
+} InputQueueStats;
+static volatile InputQueueStats input_queue_stats = {0, 0, 0, 0};
+
+// I2C error flag (result of the last DS1307 transaction)
 static volatile uint8_t i2c_error = 0;
 
+// Cumulative resource counters since boot. Each hot path adds one increment; read with ReadTelemetry().
+typedef struct {
+    uint32_t i2c_transactions;
+    uint32_t i2c_bytes;     // Register pointer plus data bytes
+    uint32_t i2c_errors;
+    uint32_t spi_frames;    // Slots latched by DisplayMultiplexed; the DMA refresh is not counted
+    uint32_t level_ms[BRIGHTNESS_LEVELS]; // Display-on time at each brightness level
+    uint32_t display_on_ms;
+    uint32_t display_off_ms;
+    uint32_t fades;
+} Telemetry;
+static volatile Telemetry telemetry;
+
+// Energy model for the estimates: replace with the figures measured for the tubes and supply in use
+#define FILAMENT_POWER_MW 250 // Filament supply, on continuously (the firmware does not switch it)
+#define GRID_POWER_MW 400     // HV supply with all grids multiplexing at 100% PWM duty
+
+typedef struct {
+    uint32_t filament_mwh_per_day;
+    uint32_t grid_mwh_per_day;
+    uint16_t average_duty_permille; // Mean PWM duty while the display was on
+    uint16_t on_time_permille;      // Share of time the display was on
+} EnergyEstimate;
+
+void ReadTelemetry(Telemetry *snapshot);
+void EstimateEnergy(const Telemetry *snapshot, EnergyEstimate *estimate);
+
+// Scheduler events, posted by ISRs, callbacks and timers with PostEvent()
+#define EVENT_DISPLAY_DIRTY   (1 << 0) // Something visible changed, see display_dirty
+#define EVENT_INPUT           (1 << 1) // Input events are waiting in input_queue
+#define EVENT_FADE_STEP       (1 << 2) // fade_timer fired
+#define EVENT_DISPLAY_TIMEOUT (1 << 3) // display_timer fired
+#define EVENT_SETTING_TIMEOUT (1 << 4) // time_setting_timer fired
+#define EVENT_RTC             (1 << 5) // One of the RtcTask timers fired
+#define EVENT_MESSAGE         (1 << 6) // message_timer fired
+#define EVENT_SERIAL          (1 << 7) // Bytes are waiting in serial_rx
+#define EVENT_SCHEDULE        (1 << 8) // Minute rollover, time change or new schedule table
+#define EVENT_SCHEDULER_STATS (1 << 9) // scheduler_stats_timer fired
+#define EVENT_TASK_TIMER      (1 << 15) // A periodic task timer fired
+static volatile uint16_t pending_events = 0;
+
+// Binary command protocol on UART_1, which the current TopDesign does not have yet. 0 compiles it out.
+#ifndef SERIAL_PROTOCOL
+#define SERIAL_PROTOCOL 0
+#endif
+
+#if (SERIAL_PROTOCOL)
+// Frame: SERIAL_SYNC, command, payload length, payload, CRC-8 (polynomial 0x07) over command to
+// payload. A reply carries the command with SERIAL_REPLY set and starts with a status byte.
+// Multi-byte values are little-endian unless noted.
+#define SERIAL_SYNC 0xA5
+#define SERIAL_REPLY 0x80
+#define SERIAL_HEADER 3
+#define SERIAL_MAX_PAYLOAD 64
+#define SERIAL_RX_SIZE 128 // Power of two, at most 128 with the 8-bit free-running indices
+#define SERIAL_VERSION 2
+
+#define SERIAL_CMD_PING 0x01       // -> version
+#define SERIAL_CMD_SET_TIME 0x10   // hours (0-23), minutes, seconds
+#define SERIAL_CMD_SET_CONFIG 0x11 // brightness level, fade curve, fade duration (10 ms), timeout (s, big-endian)
+#define SERIAL_CMD_SET_SCHEDULE 0x12 // index, then the 4-byte NVRAM entry (first byte without SCHEDULE_TAG frees it)
+#define SERIAL_CMD_GET_SCHEDULE 0x22 // -> the schedule table as stored
+#define SERIAL_CMD_TELEMETRY 0x20  // -> the Telemetry counters
+#define SERIAL_CMD_ISR_STATS 0x21  // ISR id -> count, min, max and mean cycles
+#define SERIAL_CMD_STREAM 0x30     // 1 = send every published frame, 0 = stop
+#define SERIAL_FRAME 0x31          // Unsolicited: the slot words of a published frame
+
+#define SERIAL_OK 0
+#define SERIAL_BAD_LENGTH 1
+#define SERIAL_BAD_VALUE 2
+#define SERIAL_UNSUPPORTED 3
+#define SERIAL_BUSY 4 // DS1307 queue full or RTC breaker open, retry later (SET_TIME: clock set, RTC write retried)
+
+#if (DISPLAY_SLOTS * DISPLAY_CHAIN_LENGTH * 2 > SERIAL_MAX_PAYLOAD)
+#error "A streamed frame does not fit in one serial payload"
+#endif
+
+// Receive ring, filled by the RX ISR and parsed in place by SerialTask
+static volatile uint8_t serial_rx[SERIAL_RX_SIZE];
+static volatile uint8_t serial_rx_head = 0; // Written only by the RX ISR
+static volatile uint8_t serial_rx_tail = 0; // Written only by SerialTask
+static volatile uint32_t serial_rx_overruns = 0;
+static uint32_t serial_bad_frames = 0;
+static uint8_t serial_streaming = 0;
+
+// Replies are built in place behind the header
+static uint8_t serial_tx[SERIAL_HEADER + SERIAL_MAX_PAYLOAD + 1];
+
+uint8_t Crc8Update(uint8_t crc, uint8_t data);
+uint8_t SerialPeek(uint8_t offset);
+void SendSerialFrame(uint8_t command, uint8_t length);
+void HandleSerialCommand(uint8_t command, uint8_t length);
+void SendDisplayFrame(void);
+void SerialTask(void);
+void PutLittleEndian32(uint8_t *buffer, uint32_t value);
+#endif
+
+// Software timers on a hashed wheel, advanced by the 1 ms tick. Arm and cancel are O(1). The tick
+// only scans the wheel once it reaches timer_next_deadline, a lower bound on the earliest expiry,
+// so most ticks cost one comparison. All comparisons are wrap-safe.
+#define TIMER_WHEEL_SLOTS 32 // Power of two
+typedef struct SoftTimer {
+    struct SoftTimer *next;
+    struct SoftTimer *prev;
+    uint32_t expiry;    // tick_count at which it fires
+    uint32_t period_ms; // 0 = one-shot
+    uint16_t events;    // Posted when it fires
+    uint8_t armed;
+    uint8_t fired;      // Set on expiry, cleared by TakeTimerFired() or re-arming
+} SoftTimer;
+static SoftTimer *timer_wheel[TIMER_WHEEL_SLOTS];
+static uint8_t timer_count = 0; // Armed timers
+static uint32_t timer_next_deadline = 0;
+
+void ArmTimer(SoftTimer *timer, uint32_t delay_ms, uint32_t period_ms, uint16_t events);
+void CancelTimer(SoftTimer *timer);
+uint8_t TakeTimerFired(SoftTimer *timer);
+void ProcessTimers(void);
+void LinkTimer(SoftTimer *timer);
+void UnlinkTimer(SoftTimer *timer);
+
+static SoftTimer fade_timer;          // Fade steps while a fade runs
+static SoftTimer display_timer;       // Blanks the display after the PIR has been quiet
+static SoftTimer time_setting_timer;  // Ends time-setting mode
+static SoftTimer rtc_resync_timer;    // Hourly DS1307 resync
+static SoftTimer rtc_flush_timer;     // Deferred time write
+static SoftTimer settings_flush_timer; // Deferred settings write
+static SoftTimer message_timer;       // Scroll steps, or the end of a static message
+static SoftTimer rtc_probe_timer;     // Next bus-recovery attempt while the RTC breaker is open
+static SoftTimer ds1307_watchdog;     // Aborts a transaction the I2C block never completes
+
+// RTC circuit breaker: after repeated failures the engine stops touching the bus and the clock
+// free-runs on the tick; a probe read after an exponentially growing backoff looks for the DS1307.
+#define RTC_HEALTHY 0
+#define RTC_OPEN 1      // Requests are refused
+#define RTC_HALF_OPEN 2 // Probe on the bus; one more failure reopens with a longer backoff
+#define RTC_BREAKER_THRESHOLD 3 // Consecutive failed transactions that trip the breaker
+#define RTC_BACKOFF_MIN_MS 1000
+#define RTC_BACKOFF_MAX_MS (5UL * 60 * 1000)
+#define RTC_TRANSACTION_TIMEOUT_MS 50 // The longest burst takes under 3 ms at 100 kHz
+
+typedef struct {
+    uint8_t state;
+    uint8_t consecutive_errors;
+    uint32_t backoff_ms;     // Delay before the next probe
+    uint32_t trips;
+    uint32_t timeouts;       // Transactions aborted by the watchdog
+    uint32_t bus_recoveries; // Nine-clock recovery sequences run
+} RtcHealth;
+static volatile RtcHealth rtc_health = {RTC_HEALTHY, 0, RTC_BACKOFF_MIN_MS, 0, 0, 0};
+static uint8_t rtc_degraded_shown = 0;
+
+// Messages replace the digits for a while. The text is converted to segments once, so a scroll
+// step only moves a window over them and the multiplex ISR still reads a ready frame.
+#define MESSAGE_MAX 24
+#define MESSAGE_SCROLL_MS 300
+#define MESSAGE_SHORT_MS 800
+#define MESSAGE_ERROR_MS 2000
+static uint8_t message_segments[DISPLAY_DIGITS + MESSAGE_MAX + DISPLAY_DIGITS]; // Blank-padded for scrolling
+static uint8_t message_length = 0; // Segments in use, 0 = show the clock
+static uint8_t message_offset = 0; // First segment on the display
+static uint8_t message_scrolling = 0;
+static uint8_t i2c_error_shown = 0;
+
+// Cooperative scheduler: tasks run when their timer fires or one of their events is posted
+#define MAX_TASKS 10
+#define SCHEDULER_STATS_MS 1000 // CPU utilisation window
+typedef struct {
+    void (*run)(void);
+    uint16_t events;      // Events that trigger the task
+    SoftTimer timer;      // Periodic runs, unarmed for event-driven tasks
+    uint32_t run_count;
+    uint32_t busy_cycles; // Cycles spent in the task since boot
+} Task;
+static Task tasks[MAX_TASKS];
+static uint8_t task_count = 0;
+
+// Scheduler statistics (cycle counts from the DWT cycle counter)
+typedef struct {
+    uint32_t idle_cycles;             // Cycles asleep or in handlers between main-loop passes
+    uint32_t window_start;            // DWT cycle count at the start of the current window
+    uint16_t cpu_utilisation_permille; // Main-loop time over the last complete window
+} SchedulerStats;
+static SchedulerStats scheduler_stats = {0, 0, 0};
+static SoftTimer scheduler_stats_timer;
+
+// Deferred RTC writes: time-setting changes go to the RAM clock and are flushed once
+#define RTC_FLUSH_IDLE_MS 1000 // Flush after this long without a change
+static volatile uint8_t rtc_write_pending = 0; // 1 = RAM time differs from what the DS1307 was given
+
+// Settings block in the DS1307 battery-backed RAM (0x08-0x3F), read with the time in one burst at boot
+#define NVRAM_SETTINGS_ADDRESS 0x08
+#define NVRAM_SETTINGS_SIZE 8
+#define SETTINGS_MAGIC 0x5A // Change when the layout changes
+#define SETTINGS_FLUSH_IDLE_MS 2000 // Write back after this long without a change
+// Byte layout: magic, brightness level, fade curve, fade duration (10 ms units),
+// display timeout (seconds, big-endian), reserved, checksum
+static volatile uint8_t settings_write_pending = 0;
+static uint8_t settings_shadow[NVRAM_SETTINGS_SIZE] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+// Scheduled actions in the DS1307 NVRAM (0x28-0x3F). Only the minute of the next event is kept, so
+// a minute rollover costs one compare; the table is scanned when an event fires or the time jumps.
+#define NVRAM_SCHEDULE_ADDRESS 0x28
+#define SCHEDULE_ENTRIES 6
+#define SCHEDULE_ENTRY_SIZE 4
+// Entry layout: SCHEDULE_TAG | action, hour (0-23), minute, argument. Any other first byte is a free slot.
+#define SCHEDULE_TAG 0xA0
+#define SCHEDULE_BRIGHTNESS 0   // Fade to the argument's brightness level
+#define SCHEDULE_DISPLAY_ON 1   // Wake the display for argument minutes (0 = the display timeout)
+#define SCHEDULE_DISPLAY_OFF 2  // Blank the display until motion or a button wakes it
+#define SCHEDULE_HOLD_DISPLAY 3 // Argument 1 = keep the display on regardless of the PIR, 0 = release
+#define SCHEDULE_NONE 0xFFFF
+#define SCHEDULE_STEP_BACK_MINUTES 2 // A resync that steps back this far does not replay the events it crosses
+static uint8_t schedule[SCHEDULE_ENTRIES][SCHEDULE_ENTRY_SIZE];
+static uint16_t schedule_next_minute = SCHEDULE_NONE;  // Minute of day of the next event
+static uint16_t schedule_last_minute = SCHEDULE_NONE;  // Minute of day ScheduleTask last saw
+static uint16_t schedule_fired_minute = SCHEDULE_NONE; // Minute of day whose events last ran
+static volatile uint8_t schedule_rescan = 0;          // 1 = table changed
+static uint8_t display_hold = 0;                      // 1 = the PIR timeout is ignored
+
+// Boot timing in cycles from the top of main(), which excludes the startup code before it
+typedef struct {
+    uint32_t restore_cycles;     // Boot burst read completed
+    uint32_t publish_cycles;     // First frame with the restored time published
+    uint32_t first_frame_cycles; // Every slot of that frame latched, so the tube shows it
+    uint8_t settings_restored;   // 1 = the NVRAM settings block was valid
+} BootStats;
+static volatile BootStats boot_stats = {0, 0, 0, 0};
+
 /**
- * Check PIR sensor and manage display state.
+ * Wakes the display for motion and counts the wake in the occupancy log. Safe to call from ISRs.
  */
-void CheckPIRSensor(void) {
-    if (Pin_PIR_Read() == 1) { // Motion detected
-        if (!display_on) {
-            PWM_2_WriteCompare(current_brightness);
-            display_on = 1;
-        }
-        display_timeout = tick_count + DISPLAY_TIMEOUT_MS; // Reset the timeout
-    } else if (display_on && (tick_count >= display_timeout)) {
-        // Turn off the display if timeout is reached
-        PWM_2_WriteCompare(0);
-        display_on = 0;
+void WakeDisplayOnMotion(void) {
+    uint8_t interrupts = CyEnterCriticalSection(); // The PIR ISR and the poll may both see the motion
+    if (!display_on) {
+        WakeDisplay();
+        occupancy[time_of_day / 3600].wakes++;
     }
+    CyExitCriticalSection(interrupts);
 }
 
+#if (PIR_INTERRUPT)
 /**
- * ISR handler for Timer_3 (1ms ticks).
+ * ISR handler for the PIR rising edge: wakes the display straight from the interrupt.
  */
-CY_ISR(TickInterruptHandler) {
-    Timer_3_ReadStatusRegister();
-    tick_count++; // Increment millisecond counter
+CY_ISR(PIRInterruptHandler) {
+    Pin_PIR_ClearInterrupt();
+    pir_seen = 1;
+    ArmTimer(&display_timer, display_timeout_ms, 0, EVENT_DISPLAY_TIMEOUT);
+    WakeDisplayOnMotion();
 }
+#endif
 
 /**
- * ISR handler for button press (negative edge from Debouncer).
+ * Wakes the display and restarts its timeout while the PIR output is high, and blanks the display
+ * once display_timer has fired. The level-triggered wake also catches a missed edge, and brings the
+ * display back after a scheduled DISPLAY_OFF while someone is still in the room.
  */
-static volatile uint32_t last_brightness_interrupt_time = 0;
-CY_ISR(ButtonPressInterruptHandler) {
-    isr_3_ClearPending(); // Clear the interrupt
-    if (tick_count - last_brightness_interrupt_time < 50) return; // Software debounce
-    last_brightness_interrupt_time = tick_count;
-    
-    // Only start a new fade if not currently fading
-    if (!fading) {
-        // Store the current brightness as the starting point for the fade
-        start_brightness = current_brightness;
-        
-        // Increase brightness level, loop back to min if at maximum
-        if (brightness_level >= BRIGHTNESS_LEVELS - 1) {
-            brightness_level = 0; // Loop back to min brightness
-        } else {
-            brightness_level++;
-        }
-        
-        // Set the target brightness and start fading
-        target_brightness = brightness_values[brightness_level];
-        fading = 1;
-        fade_start_time = tick_count;
-        
-        // If display is off, turn it on at the new brightness
-        if (!display_on) {
-            PWM_2_WriteCompare(current_brightness);
-            display_on = 1;
-            display_timeout = tick_count + DISPLAY_TIMEOUT_MS;
-        }
+void CheckPIRSensor(void) {
+    if (Pin_PIR_Read() == 1) { // Motion still present
+        pir_seen = 1;
+        ArmTimer(&display_timer, display_timeout_ms, 0, EVENT_DISPLAY_TIMEOUT); // Reset the timeout
+        WakeDisplayOnMotion();
+    } else if (TakeTimerFired(&display_timer) && display_on && !display_hold) {
+        // Turn off the display if timeout is reached
+        BlankDisplay();
     }
 }
 
 /**
- * ISR handler for UP button press (negative edge).
+ * Accounts each minute in the occupancy histogram, and folds every completed hour into the
+ * running average kept in NVRAM.
  */
-static volatile uint32_t last_up_interrupt_time = 0;
-CY_ISR(UpButtonPressInterruptHandler) {
-    isr_4_ClearPending(); // Clear the interrupt
-    if (tick_count - last_up_interrupt_time < 50) return; // Software debounce
-    last_up_interrupt_time = tick_count;
+void OccupancyTask(void) {
+    uint32_t time = time_of_day;
+    uint8_t minute = (time / 60) % 60;
+    uint8_t hour = time / 3600;
     
-    if (!time_setting_mode) {
-        time_setting_mode = 1;
-        seconds = 0;
-        dots_on = 1;
-        adjustment_speed = 0; // Reset speed only when entering time-setting mode
+    if (minute == occupancy_minute) {
+        return;
     }
     
-    if (button_pressed == 0) {
-        button_pressed = 1; // UP button
-        button_press_start = tick_count;
-        last_button_activity = tick_count;
-        
-        // Immediate single-minute adjustment
-        minutes++;
-        if (minutes >= 60) {
-            minutes = 0;
-            hours++;
-            if (hours >= 24) {
-                hours = 0;
-            }
+    uint8_t interrupts = CyEnterCriticalSection();
+    uint8_t seen = pir_seen;
+    pir_seen = 0;
+    CyExitCriticalSection(interrupts);
+    
+    // Minutes skipped or repeated while the time is being set are not accounted
+    if (occupancy_minute != 0xFF && !time_setting_mode) {
+        if (seen) {
+            occupancy[occupancy_hour].active_minutes++;
+            occupancy_this_hour++;
         }
-        WriteTimeToDS1307();
-        UpdateDisplayTime();
+        
+        if (hour != occupancy_hour) {
+            uint8_t *average = &occupancy_average[occupancy_hour];
+            *average = (uint8_t)(((uint16_t)*average * 7 + occupancy_this_hour) >> 3);
+            occupancy_unsaved |= 1UL << occupancy_hour;
+        }
+    }
+    
+#if (OCCUPANCY_NVRAM)
+    // A full queue leaves the hour marked, and the next minute tries again
+    for (uint8_t i = 0; i < 24 && occupancy_unsaved != 0; i++) {
+        if ((occupancy_unsaved & (1UL << i)) &&
+            PostDS1307Request(1, NVRAM_OCCUPANCY_ADDRESS + i, &occupancy_average[i], 1, NULL)) {
+            occupancy_unsaved &= ~(1UL << i);
+        }
+    }
+#endif
+    
+    if (hour != occupancy_hour) {
+        occupancy_this_hour = 0;
     }
+    occupancy_minute = minute;
+    occupancy_hour = hour;
 }
 
 /**
- * ISR handler for DOWN button press (negative edge).
+ * Runs the events due at each minute rollover. A minute that does not follow the last one seen
+ * (boot, time set, resync or serial command) moves the next-event pointer and rebuilds the hold and
+ * brightness levels whose events the jump skipped; skipped display on/off events are not replayed.
+ * Nor are events the clock reaches again after a resync stepped it back. While the time is being set
+ * nothing runs: the minutes stepped through are not a jump until ButtonTask leaves setting mode.
  */
-static volatile uint32_t last_down_interrupt_time = 0;
-CY_ISR(DownButtonPressInterruptHandler) {
-    isr_5_ClearPending(); // Clear the interrupt
-    if (tick_count - last_down_interrupt_time < 50) return; // Software debounce
-    last_down_interrupt_time = tick_count;
+void ScheduleTask(void) {
+    uint16_t now = time_of_day / 60;
     
-    if (!time_setting_mode) {
-        time_setting_mode = 1;
-        seconds = 0;
-        dots_on = 1;
-        adjustment_speed = 0; // Reset speed only when entering time-setting mode
+    if ((now == schedule_last_minute && !schedule_rescan) || time_setting_mode) {
+        return;
     }
     
-    if (button_pressed == 0) {
-        button_pressed = 2; // DOWN button
-        button_press_start = tick_count;
-        last_button_activity = tick_count;
-        
-        // Immediate single-minute adjustment
-        if (minutes == 0) {
-            minutes = 59;
-            if (hours == 0) {
-                hours = 23;
-            } else {
-                hours--;
-            }
-        } else {
-            minutes--;
+    // Forget the fired minute once the clock is past it, so the events fire again tomorrow
+    if (schedule_fired_minute != SCHEDULE_NONE &&
+        (schedule_fired_minute + 24 * 60 - now) % (24 * 60) > SCHEDULE_STEP_BACK_MINUTES) {
+        schedule_fired_minute = SCHEDULE_NONE;
+    }
+    
+    uint16_t expected = (schedule_last_minute >= 24 * 60 - 1) ? 0 : schedule_last_minute + 1;
+    if (schedule_rescan || now != expected) {
+        // Boot and a new table rebuild every level; a jump only those whose events it skipped
+        RestoreScheduledLevels(schedule_rescan ? SCHEDULE_NONE : schedule_last_minute, now);
+        schedule_rescan = 0;
+        RescanSchedule(now);
+    } else if (now == schedule_next_minute) {
+        if (now != schedule_fired_minute) {
+            RunScheduledActions(now);
+            schedule_fired_minute = now;
         }
-        WriteTimeToDS1307();
-        UpdateDisplayTime();
+        RescanSchedule(now);
     }
+    schedule_last_minute = now;
 }
 
 /**
- * Check if DS1307 needs initialization and set time to 11:11 AM if so.
+ * Finds the first event after the given minute of day, wrapping at midnight.
  */
-void InitializeDS1307(uint8_t *initialized) {
-    uint8_t buffer;
-    uint8_t status;
-    uint8_t retries = 3;
+void RescanSchedule(uint16_t now) {
+    uint16_t best_distance = SCHEDULE_NONE;
     
-    *initialized = 0;
-    
-    while (retries > 0) {
-        status = I2C_1_MasterSendStart(DS1307_ADDRESS, I2C_1_WRITE_XFER_MODE);
-        if (status != I2C_1_MSTR_NO_ERROR) {
-            i2c_error = 1;
-            I2C_1_MasterSendStop();
-            retries--;
-            CyDelay(10);
+    schedule_next_minute = SCHEDULE_NONE;
+    for (uint8_t i = 0; i < SCHEDULE_ENTRIES; i++) {
+        if ((schedule[i][0] & 0xF0) != SCHEDULE_TAG) {
             continue;
         }
-        status = I2C_1_MasterWriteByte(0x00);
-        if (status != I2C_1_MSTR_NO_ERROR) {
-            i2c_error = 1;
-            I2C_1_MasterSendStop();
-            retries--;
-            CyDelay(10);
-            continue;
+        uint16_t minute = (uint16_t)schedule[i][1] * 60 + schedule[i][2];
+        uint16_t distance = (minute > now) ? minute - now : minute + 24 * 60 - now; // A full day when equal
+        if (distance < best_distance) {
+            best_distance = distance;
+            schedule_next_minute = minute;
         }
-        I2C_1_MasterSendStop();
-        
-        status = I2C_1_MasterSendStart(DS1307_ADDRESS, I2C_1_READ_XFER_MODE);
-        if (status != I2C_1_MSTR_NO_ERROR) {
-            i2c_error = 1;
-            I2C_1_MasterSendStop();
-            retries--;
-            CyDelay(10);
+    }
+}
+
+/**
+ * Applies every event set for the given minute of day, through the same paths as the buttons and the PIR.
+ */
+void RunScheduledActions(uint16_t now) {
+    for (uint8_t i = 0; i < SCHEDULE_ENTRIES; i++) {
+        const uint8_t *entry = schedule[i];
+        if ((entry[0] & 0xF0) != SCHEDULE_TAG || (uint16_t)entry[1] * 60 + entry[2] != now) {
             continue;
         }
-        buffer = I2C_1_MasterReadByte(I2C_1_NAK_DATA);
-        I2C_1_MasterSendStop();
         
-        if (I2C_1_MasterStatus() & (I2C_1_MSTAT_ERR_ADDR_NAK | I2C_1_MSTAT_ERR_XFER)) {
-            i2c_error = 1;
-            retries--;
-            CyDelay(10);
+        switch (entry[0] & 0x0F) {
+            case SCHEDULE_BRIGHTNESS:
+                SetScheduledBrightness(entry[3]);
+                break;
+                
+            case SCHEDULE_DISPLAY_ON:
+                if (!display_on) {
+                    WakeDisplay();
+                }
+                ArmTimer(&display_timer, (entry[3] != 0) ? (uint32_t)entry[3] * 60000 : display_timeout_ms,
+                         0, EVENT_DISPLAY_TIMEOUT);
+                break;
+                
+            case SCHEDULE_DISPLAY_OFF:
+                CancelTimer(&display_timer);
+                if (display_on && !display_hold) {
+                    BlankDisplay();
+                }
+                break;
+                
+            case SCHEDULE_HOLD_DISPLAY:
+                SetDisplayHold(entry[3] ? 1 : 0);
+                break;
+                
+            default:
+                break;
+        }
+    }
+}
+
+/**
+ * Sets the hold and brightness levels from the latest entries at or before the given minute of day,
+ * wrapping at midnight, as if the clock had run through them. Without a hold entry the hold is released.
+ * After a jump from another minute only the levels with a skipped event change; from = SCHEDULE_NONE
+ * sets both.
+ */
+void RestoreScheduledLevels(uint16_t from, uint16_t now) {
+    uint16_t hold_age = SCHEDULE_NONE;
+    uint16_t brightness_age = SCHEDULE_NONE;
+    uint8_t hold = 0;
+    uint8_t level = brightness_level;
+    
+    for (uint8_t i = 0; i < SCHEDULE_ENTRIES; i++) {
+        const uint8_t *entry = schedule[i];
+        if ((entry[0] & 0xF0) != SCHEDULE_TAG) {
             continue;
         }
+        uint16_t minute = (uint16_t)entry[1] * 60 + entry[2];
+        uint16_t age = (now >= minute) ? now - minute : now + 24 * 60 - minute;
         
-        i2c_error = 0;
-        break;
+        if ((entry[0] & 0x0F) == SCHEDULE_HOLD_DISPLAY && age < hold_age) {
+            hold_age = age;
+            hold = entry[3] ? 1 : 0;
+        } else if ((entry[0] & 0x0F) == SCHEDULE_BRIGHTNESS && age < brightness_age) {
+            brightness_age = age;
+            level = entry[3];
+        }
     }
     
-    if (i2c_error) {
-        return;
+    // A level set by hand since the last event stands unless the jump skipped another one
+    if (hold != display_hold && (from == SCHEDULE_NONE || ScheduleEntrySkipped(SCHEDULE_HOLD_DISPLAY, from, now))) {
+        SetDisplayHold(hold);
+    }
+    if (brightness_age != SCHEDULE_NONE &&
+        (from == SCHEDULE_NONE || ScheduleEntrySkipped(SCHEDULE_BRIGHTNESS, from, now))) {
+        SetScheduledBrightness(level);
     }
+}
+
+/**
+ * Returns 1 if an entry with the given action falls in the minutes a jump skipped: (from, now] going
+ * forwards, or (now, from] when the shorter way round the day is backwards.
+ */
+uint8_t ScheduleEntrySkipped(uint8_t action, uint16_t from, uint16_t now) {
+    uint16_t forward = (now + 24 * 60 - from) % (24 * 60);
+    uint8_t backwards = forward > 12 * 60;
+    uint16_t span = backwards ? 24 * 60 - forward : forward;
+    uint16_t start = backwards ? now : from;
     
-    if (buffer & 0x80) {
-        hours = 11;
-        minutes = 11;
-        seconds = 0;
-        WriteTimeToDS1307();
-        
-        ReadTimeFromDS1307();
-        if (i2c_error || hours != 11 || minutes != 11 || seconds != 0) {
-            i2c_error = 1;
-        } else {
-            *initialized = 1;
+    for (uint8_t i = 0; i < SCHEDULE_ENTRIES; i++) {
+        const uint8_t *entry = schedule[i];
+        if ((entry[0] & 0xF0) != SCHEDULE_TAG || (entry[0] & 0x0F) != action) {
+            continue;
+        }
+        uint16_t offset = ((uint16_t)entry[1] * 60 + entry[2] + 24 * 60 - start) % (24 * 60);
+        if (offset != 0 && offset <= span) {
+            return 1;
         }
     }
+    return 0;
 }
 
 /**
- * Read time from DS1307.
+ * Holds the display on regardless of the PIR, or releases the hold.
  */
-void ReadTimeFromDS1307(void) {
-    uint8_t buffer[3];
-    uint8_t status;
-    
-    status = I2C_1_MasterSendStart(DS1307_ADDRESS, I2C_1_WRITE_XFER_MODE);
-    if (status != I2C_1_MSTR_NO_ERROR) {
-        i2c_error = 1;
-        I2C_1_MasterSendStop();
-        return;
+void SetDisplayHold(uint8_t hold) {
+    display_hold = hold;
+    if (hold && !display_on) {
+        WakeDisplay();
     }
-    status = I2C_1_MasterWriteByte(0x00);
-    if (status != I2C_1_MSTR_NO_ERROR) {
-        i2c_error = 1;
-        I2C_1_MasterSendStop();
-        return;
+    // On release the display stays on for one more timeout
+    ArmTimer(&display_timer, display_timeout_ms, 0, EVENT_DISPLAY_TIMEOUT);
+}
+
+/**
+ * Fades to a scheduled brightness level and persists it, unless it is already set.
+ */
+void SetScheduledBrightness(uint8_t level) {
+    if (level < BRIGHTNESS_LEVELS && level != brightness_level) {
+        brightness_level = level;
+        StartFade(brightness_level);
+        MarkSettingsChanged();
     }
-    I2C_1_MasterSendStop();
+}
+
+/**
+ * Advances the software clock by one second.
+ */
+void AdvanceSecond(void) {
+    uint8_t dirty = DISPLAY_SHOWS_SECONDS ? DIRTY_DIGITS : 0;
     
-    status = I2C_1_MasterSendStart(DS1307_ADDRESS, I2C_1_READ_XFER_MODE);
-    if (status != I2C_1_MSTR_NO_ERROR) {
-        i2c_error = 1;
-        I2C_1_MasterSendStop();
-        return;
+    uint32_t time = (time_of_day + 1) % SECONDS_PER_DAY;
+    time_of_day = time;
+    if (time % 60 == 0) {
+        dirty = DIRTY_DIGITS;
+        PostEvent(EVENT_SCHEDULE);
     }
-    buffer[0] = I2C_1_MasterReadByte(I2C_1_ACK_DATA);
-    buffer[1] = I2C_1_MasterReadByte(I2C_1_ACK_DATA);
-    buffer[2] = I2C_1_MasterReadByte(I2C_1_NAK_DATA);
-    I2C_1_MasterSendStop();
     
-    if (I2C_1_MasterStatus() & (I2C_1_MSTAT_ERR_ADDR_NAK | I2C_1_MSTAT_ERR_XFER)) {
-        i2c_error = 1;
-        return;
+    // The dots stay lit while the time is being set. A minute is an even number of seconds,
+    // so the parity of the whole word is that of the seconds.
+    if (!time_setting_mode) {
+        uint8_t dots = (time & 1) ? 0 : 1;
+        if (dots != dots_on) {
+            dots_on = dots;
+            dirty |= DIRTY_DOTS;
+        }
     }
     
-    seconds = (buffer[0] & 0x0F) + ((buffer[0] >> 4) * 10);
-    minutes = (buffer[1] & 0x0F) + ((buffer[1] >> 4) * 10);
-    
-    if (buffer[2] & 0x40) {
-        uint8_t hour_bcd = buffer[2] & 0x1F;
-        hours = (hour_bcd & 0x0F) + ((hour_bcd >> 4) * 10);
-        if (buffer[2] & 0x20) {
-            hours = (hours % 12) + 12;
-        } else {
-            hours = hours % 12;
-        }
+    if (dirty) {
+        MarkDisplayDirty(dirty);
     } else {
-        hours = (buffer[2] & 0x3F) + ((buffer[2] >> 4) * 10);
+        render_stats.avoided_renders++;
     }
-    
-    dots_on = (seconds % 2 == 0) ? 1 : 0;
 }
 
 /**
- * Write time to DS1307.
+ * ISR handler for Timer_3 (1ms ticks).
  */
-void WriteTimeToDS1307(void) {
-    uint8_t buffer[3];
-    uint8_t status;
+CY_ISR(TickInterruptHandler) {
+    ISR_PROFILE_ENTER(ISR_ID_TICK);
+    Timer_3_ReadStatusRegister();
+    tick_count++; // Increment millisecond counter
+    ProcessTimers();
     
-    buffer[0] = ((seconds / 10) << 4) | (seconds % 10);
-    buffer[1] = ((minutes / 10) << 4) | (minutes % 10);
-    
-    uint8_t display_hours = hours;
-    uint8_t am_pm = 0;
-    if (hours == 0) {
-        display_hours = 12;
-    } else if (hours == 12) {
-        display_hours = 12;
-        am_pm = 1;
-    } else if (hours > 12) {
-        display_hours = hours - 12;
-        am_pm = 1;
-    }
-    buffer[2] = 0x40;
-    buffer[2] |= (am_pm << 5);
-    buffer[2] |= ((display_hours / 10) << 4) | (display_hours % 10);
-    
-    status = I2C_1_MasterSendStart(DS1307_ADDRESS, I2C_1_WRITE_XFER_MODE);
-    if (status != I2C_1_MSTR_NO_ERROR) {
-        i2c_error = 1;
-        I2C_1_MasterSendStop();
-        return;
-    }
-    status = I2C_1_MasterWriteByte(0x00);
-    if (status != I2C_1_MSTR_NO_ERROR) {
-        i2c_error = 1;
-        I2C_1_MasterSendStop();
-        return;
+    if (display_on) {
+        telemetry.display_on_ms++;
+        telemetry.level_ms[brightness_level]++;
+    } else {
+        telemetry.display_off_ms++;
     }
-    status = I2C_1_MasterWriteByte(buffer[0]);
-    if (status != I2C_1_MSTR_NO_ERROR) {
-        i2c_error = 1;
-        I2C_1_MasterSendStop();
-        return;
+    
+    if (++millis_in_second >= 1000) {
+        millis_in_second = 0;
+        AdvanceSecond();
     }
-    status = I2C_1_MasterWriteByte(buffer[1]);
-    if (status != I2C_1_MSTR_NO_ERROR) {
-        i2c_error = 1;
-        I2C_1_MasterSendStop();
+    
+    SampleButtons();
+    ISR_PROFILE_EXIT(ISR_ID_TICK);
+}
+
+/**
+ * Pushes an input event for InputTask. Called from the tick ISR only.
+ */
+void PushInputEvent(uint8_t button, uint8_t kind, uint8_t step) {
+    uint8_t head = input_queue_head;
+    uint8_t depth = (uint8_t)(head - input_queue_tail);
+    
+    if (depth >= INPUT_QUEUE_SIZE) {
+        input_queue_stats.dropped++;
         return;
     }
-    status = I2C_1_MasterWriteByte(buffer[2]);
-    if (status != I2C_1_MSTR_NO_ERROR) {
-        i2c_error = 1;
-        I2C_1_MasterSendStop();
-        return;
+    
+    volatile InputEvent *event = &input_queue[head & (INPUT_QUEUE_SIZE - 1)];
+    event->button = button;
+    event->kind = kind;
+    event->step = step;
+    event->timestamp = tick_count;
+    __DMB(); // Publish the entry before the index
+    input_queue_head = head + 1;
+    
+    input_queue_stats.pushed++;
+    if (depth + 1 > input_queue_stats.high_water) {
+        input_queue_stats.high_water = depth + 1;
     }
-    I2C_1_MasterSendStop();
+    PostEvent(EVENT_INPUT);
+}
+
+/**
+ * Samples the buttons (active low) with an integrating debounce and generates the input events.
+ * Runs from the 1 ms tick.
+ */
+void SampleButtons(void) {
+    uint8_t samples[BUTTON_COUNT];
+    samples[BUTTON_BRIGHTNESS] = (Pin_Brightness_Read() == 0);
+    samples[BUTTON_UP] = (Pin_Up_Read() == 0);
+    samples[BUTTON_DOWN] = (Pin_Down_Read() == 0);
     
-    if (I2C_1_MasterStatus() & (I2C_1_MSTAT_ERR_ADDR_NAK | I2C_1_MSTAT_ERR_XFER)) {
-        i2c_error = 1;
+    for (uint8_t i = 0; i < BUTTON_COUNT; i++) {
+        ButtonState *button = &button_states[i];
+        const ButtonConfig *config = &button_config[i];
+        
+        if (samples[i]) {
+            if (button->integrator < BUTTON_INTEGRATOR_MAX) {
+                button->integrator++;
+            }
+        } else if (button->integrator > 0) {
+            button->integrator--;
+        }
+        
+        if (!button->pressed) {
+            if (button->integrator == BUTTON_INTEGRATOR_MAX) {
+                button->pressed = 1;
+                button->stage = 0;
+                button->long_sent = 0;
+                button->press_time = tick_count;
+                PushInputEvent(i, INPUT_PRESS, 0);
+            }
+            continue;
+        }
+        
+        if (button->integrator == 0) {
+            button->pressed = 0;
+            PushInputEvent(i, INPUT_RELEASE, 0);
+            continue;
+        }
+        
+        uint32_t held = tick_count - button->press_time;
+        
+        if (config->long_press_ms != 0 && !button->long_sent && held >= config->long_press_ms) {
+            button->long_sent = 1;
+            PushInputEvent(i, INPUT_LONG_PRESS, 0);
+        }
+        
+        if (button->stage < config->stages && held >= config->curve[button->stage].hold_ms) {
+            if (button->stage == 0) {
+                button->next_repeat = tick_count; // First repeat as soon as the curve starts
+            }
+            button->stage++;
+        }
+        
+        if (button->stage > 0 && (int32_t)(tick_count - button->next_repeat) >= 0) {
+            const RepeatStage *stage = &config->curve[button->stage - 1];
+            button->next_repeat = tick_count + stage->repeat_ms;
+            PushInputEvent(i, INPUT_REPEAT, stage->step);
+        }
     }
 }
 
 /**
- * Updates the display digits based on the current time (12-hour format).
+ * Queues a DS1307 transaction and starts it if the bus is idle. Safe to call from ISRs.
+ * Returns 0 if nothing was queued; done has then already run with DS1307_ERR_BUSY (queue full) or
+ * DS1307_ERR_REFUSED (RTC breaker open), so a completion that retries on error covers both.
  */
-void UpdateDisplayTime(void) {
-    uint8_t display_hours = hours;
+uint8_t PostDS1307Request(uint8_t write, uint8_t reg, const uint8_t *data, uint8_t length, DS1307Callback done) {
+    if (length > DS1307_MAX_DATA) {
+        return 0;
+    }
     
-    if (display_hours == 0) {
-        display_hours = 12;
-    } else if (display_hours > 12) {
-        display_hours -= 12;
+    uint8_t interrupts = CyEnterCriticalSection();
+    if (rtc_health.state == RTC_OPEN) {
+        // Fail fast: the caller's retry path runs now instead of after a bus timeout
+        CyExitCriticalSection(interrupts);
+        if (done != NULL) {
+            done(DS1307_ERR_REFUSED, NULL);
+        }
+        return 0;
+    }
+    if (ds1307_queue_count >= DS1307_QUEUE_SIZE) {
+        CyExitCriticalSection(interrupts);
+        if (done != NULL) {
+            done(DS1307_ERR_BUSY, NULL);
+        }
+        return 0;
     }
     
-    uint8_t hours_tens = display_hours / 10;
-    uint8_t hours_ones = display_hours % 10;
-    uint8_t minutes_tens = minutes / 10;
-    uint8_t minutes_ones = minutes % 10;
+    DS1307Request *request = &ds1307_queue[(ds1307_queue_head + ds1307_queue_count) & (DS1307_QUEUE_SIZE - 1)];
+    request->write = write;
+    request->length = length;
+    request->buffer[0] = reg;
+    if (write) {
+        for (uint8_t i = 0; i < length; i++) {
+            request->buffer[i + 1] = data[i];
+        }
+    }
+    request->done = done;
+    ds1307_queue_count++;
     
-    uint8_t interrupts = CyEnterCriticalSection();
-    display_digits[0] = hours_tens;
-    display_digits[1] = hours_ones;
-    display_digits[2] = minutes_tens;
-    display_digits[3] = minutes_ones;
+    if (ds1307_state == DS1307_IDLE) {
+        StartNextDS1307Request();
+    }
     CyExitCriticalSection(interrupts);
+    return 1;
 }
 
 /**
- * Displays the current digit or dots in the multiplexing cycle.
+ * Starts the request at the head of the queue using the non-blocking I2C_1 buffer API.
  */
-void DisplayMultiplexed(uint8_t position) {
-    uint16_t data1 = 0;
-    uint16_t data2 = 0x001;
-    
-    if (position < 4) {
-        uint8_t segments = segment_patterns[display_digits[position]];
-        data1 = segments & 0x7F;
-        uint16_t digit_bits = 0;
-        switch (position) {
-            case 0: digit_bits = (1 << 0); break;
-            case 1: digit_bits = (1 << 1); break;
-            case 2: digit_bits = (1 << 2); break;
-            case 3: digit_bits = (1 << 3); break;
-        }
-        data1 |= (digit_bits << 7);
-    } else {
-        data2 = dots_on ? 0x007 : 0x000;
+void StartNextDS1307Request(void) {
+    if (ds1307_queue_count == 0) {
+        ds1307_state = DS1307_IDLE;
+        return;
     }
     
-    SPIM_1_ClearTxBuffer();
-    SPIM_1_ClearRxBuffer();
+    // Requests queued before the breaker tripped are refused rather than sent
+    if (rtc_health.state == RTC_OPEN) {
+        FinishDS1307Request(DS1307_ERR_REFUSED);
+        return;
+    }
     
-    Pin_LOAD_Write(0);
+    DS1307Request *request = &ds1307_queue[ds1307_queue_head];
+    uint8_t status;
     
-    SPIM_1_WriteTxData(data2);
-    SPIM_1_WriteTxData(data1);
+    ArmTimer(&ds1307_watchdog, RTC_TRANSACTION_TIMEOUT_MS, 0, EVENT_RTC);
+    I2C_1_MasterClearStatus();
+    if (request->write) {
+        ds1307_state = DS1307_WRITING;
+        status = I2C_1_MasterWriteBuf(DS1307_ADDRESS, request->buffer, request->length + 1, I2C_1_MODE_COMPLETE_XFER);
+    } else {
+        ds1307_state = DS1307_SET_POINTER;
+        status = I2C_1_MasterWriteBuf(DS1307_ADDRESS, request->buffer, 1, I2C_1_MODE_NO_STOP);
+    }
+    
+    if (status != I2C_1_MSTR_NO_ERROR) {
+        FinishDS1307Request(I2C_1_MSTAT_ERR_XFER);
+    }
+}
+
+/**
+ * Completes the request at the head of the queue and moves on to the next one.
+ */
+void FinishDS1307Request(uint8_t status) {
+    DS1307Request *request = &ds1307_queue[ds1307_queue_head];
+    
+    if (status != DS1307_ERR_REFUSED) {
+        CancelTimer(&ds1307_watchdog);
+        telemetry.i2c_transactions++;
+        telemetry.i2c_bytes += request->length + 1;
+        if (status != 0) {
+            telemetry.i2c_errors++;
+        }
+        
+        i2c_error = (status != 0) ? 1 : 0;
+        if (i2c_error != i2c_error_shown) {
+            PostEvent(EVENT_DISPLAY_DIRTY); // DisplayTask shows "Err"
+        }
+        RecordDS1307Result(status);
+    }
+    
+    // The slot stays reserved while the callback runs, so it can post follow-up requests
+    if (request->done != NULL) {
+        request->done(status, &request->buffer[1]);
+    }
+    
+    ds1307_queue_head = (ds1307_queue_head + 1) & (DS1307_QUEUE_SIZE - 1);
+    ds1307_queue_count--;
+    StartNextDS1307Request();
+}
+
+/**
+ * Advances the DS1307 transaction state machine. Runs at the end of every I2C_1 interrupt.
+ */
+void AdvanceDS1307Transaction(void) {
+    uint8_t status = I2C_1_MasterStatus();
+    uint8_t errors = status & I2C_1_MSTAT_ERR_MASK;
+    
+    switch (ds1307_state) {
+        case DS1307_SET_POINTER:
+            if (errors) {
+                FinishDS1307Request(errors);
+            } else if (status & I2C_1_MSTAT_WR_CMPLT) {
+                DS1307Request *request = &ds1307_queue[ds1307_queue_head];
+                I2C_1_MasterClearStatus();
+                ds1307_state = DS1307_READING;
+                if (I2C_1_MasterReadBuf(DS1307_ADDRESS, &request->buffer[1], request->length,
+                                        I2C_1_MODE_REPEAT_START) != I2C_1_MSTR_NO_ERROR) {
+                    FinishDS1307Request(I2C_1_MSTAT_ERR_XFER);
+                }
+            }
+            break;
+        case DS1307_READING:
+            if (errors) {
+                FinishDS1307Request(errors);
+            } else if (status & I2C_1_MSTAT_RD_CMPLT) {
+                FinishDS1307Request(0);
+            }
+            break;
+        case DS1307_WRITING:
+            if (errors) {
+                FinishDS1307Request(errors);
+            } else if (status & I2C_1_MSTAT_WR_CMPLT) {
+                FinishDS1307Request(0);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * I2C_1 ISR exit hook, enabled by I2C_1_ISR_EXIT_CALLBACK in cyapicallbacks.h.
+ */
+void I2C_1_ISR_ExitCallback(void) {
+    AdvanceDS1307Transaction();
+}
+
+/**
+ * Packed BCD to binary; the tens multiply is shifts and adds.
+ */
+uint8_t BcdToBinary(uint8_t bcd) {
+    uint8_t tens = bcd >> 4;
+    return (bcd & 0x0F) + (tens << 3) + (tens << 1);
+}
+
+/**
+ * True if both nibbles are decimal digits and the value is at most max.
+ */
+uint8_t IsBcdInRange(uint8_t bcd, uint8_t max) {
+    return (bcd & 0x0F) <= 9 && (bcd >> 4) <= 9 && BcdToBinary(bcd) <= max;
+}
+
+/**
+ * Feeds a transaction result to the RTC circuit breaker. Runs inside FinishDS1307Request.
+ */
+void RecordDS1307Result(uint8_t status) {
+    if (status == 0) {
+        rtc_health.consecutive_errors = 0;
+        if (rtc_health.state != RTC_HEALTHY) {
+            // The probe got through: close, and let the queued retries and the resync go out
+            rtc_health.state = RTC_HEALTHY;
+            rtc_health.backoff_ms = RTC_BACKOFF_MIN_MS;
+            CancelTimer(&rtc_probe_timer);
+            PostEvent(EVENT_DISPLAY_DIRTY);
+        }
+        return;
+    }
+    
+    if (rtc_health.consecutive_errors < 255) {
+        rtc_health.consecutive_errors++;
+    }
+    if (rtc_health.state == RTC_HALF_OPEN) {
+        rtc_health.backoff_ms = (rtc_health.backoff_ms >= RTC_BACKOFF_MAX_MS / 2) ? RTC_BACKOFF_MAX_MS
+                                                                                 : rtc_health.backoff_ms * 2;
+    } else if (rtc_health.state != RTC_HEALTHY || rtc_health.consecutive_errors < RTC_BREAKER_THRESHOLD) {
+        return;
+    } else {
+        rtc_health.trips++;
+        PostEvent(EVENT_DISPLAY_DIRTY);
+    }
+    rtc_health.state = RTC_OPEN;
+    ArmTimer(&rtc_probe_timer, rtc_health.backoff_ms, 0, EVENT_RTC);
+}
+
+/**
+ * Abandons a transaction the watchdog caught: resets the I2C block and fails the request.
+ * The fired flag is taken in the same critical section as the abort. A transaction that completes
+ * first cancels the watchdog and the next one re-arms it, so a fresh transaction is never aborted.
+ */
+void AbortDS1307Request(void) {
+    uint8_t interrupts = CyEnterCriticalSection();
+    if (TakeTimerFired(&ds1307_watchdog) && ds1307_state != DS1307_IDLE) {
+        rtc_health.timeouts++;
+        I2C_1_Stop();
+        I2C_1_Start();
+        FinishDS1307Request(DS1307_ERR_TIMEOUT);
+    }
+    CyExitCriticalSection(interrupts);
+}
+
+/**
+ * Frees a bus held by a slave stuck mid-byte: up to nine SCL clocks until SDA is released, then a STOP.
+ * The pins are taken from the I2C block through their bypass bits. Call only while the engine is idle.
+ */
+void RecoverI2CBus(void) {
+    I2C_1_Stop();
+    SCL_1_Write(1);
+    SDA_1_Write(1);
+    CY_SET_REG8(SCL_1__BYP, CY_GET_REG8(SCL_1__BYP) & ~SCL_1__MASK);
+    CY_SET_REG8(SDA_1__BYP, CY_GET_REG8(SDA_1__BYP) & ~SDA_1__MASK);
+    CyDelayUs(5);
+    
+    for (uint8_t i = 0; i < 9 && SDA_1_Read() == 0; i++) {
+        SCL_1_Write(0);
+        CyDelayUs(5);
+        SCL_1_Write(1);
+        CyDelayUs(5);
+    }
+    
+    // STOP: SDA rises while SCL is high
+    SCL_1_Write(0);
+    SDA_1_Write(0);
+    CyDelayUs(5);
+    SCL_1_Write(1);
+    CyDelayUs(5);
+    SDA_1_Write(1);
+    CyDelayUs(5);
+    
+    CY_SET_REG8(SCL_1__BYP, CY_GET_REG8(SCL_1__BYP) | SCL_1__MASK);
+    CY_SET_REG8(SDA_1__BYP, CY_GET_REG8(SDA_1__BYP) | SDA_1__MASK);
+    I2C_1_Start();
+    rtc_health.bus_recoveries++;
+}
+
+/**
+ * Decodes the DS1307 seconds/minutes/hours registers into seconds since midnight.
+ * Returns TIME_INVALID if any register is not a valid BCD time, so a corrupt read never
+ * becomes a time_of_day that indexes past the conversion tables.
+ */
+uint32_t DecodeTimeRegisters(const uint8_t *buffer) {
+    uint8_t second_bcd = buffer[0] & 0x7F; // Mask the CH bit
+    uint8_t minute_bcd = buffer[1] & 0x7F;
+    uint8_t hour;
+    
+    if (!IsBcdInRange(second_bcd, 59) || !IsBcdInRange(minute_bcd, 59)) {
+        return TIME_INVALID;
+    }
+    
+    if (buffer[2] & 0x40) {
+        uint8_t hour_bcd = buffer[2] & 0x1F;
+        if (hour_bcd == 0 || !IsBcdInRange(hour_bcd, 12)) {
+            return TIME_INVALID;
+        }
+        // 12 AM/PM reads as 0 of its half-day
+        hour = BcdToBinary(hour_bcd) % 12 + ((buffer[2] & 0x20) ? 12 : 0);
+    } else {
+        uint8_t hour_bcd = buffer[2] & 0x3F;
+        if (!IsBcdInRange(hour_bcd, 23)) {
+            return TIME_INVALID;
+        }
+        hour = BcdToBinary(hour_bcd);
+    }
+    
+    return TIME_OF_DAY(hour, BcdToBinary(minute_bcd), BcdToBinary(second_bcd));
+}
+
+/**
+ * Encodes seconds since midnight into DS1307 seconds/minutes/hours registers (12-hour mode).
+ */
+void EncodeTimeRegisters(uint32_t time, uint8_t *buffer) {
+    uint8_t hour = time / 3600;
+    
+    buffer[0] = bcd_from_binary[time % 60];
+    buffer[1] = bcd_from_binary[(time / 60) % 60];
+    buffer[2] = 0x40 | ((hour >= 12) ? 0x20 : 0) | bcd_from_binary[hour12_from_hour24[hour]];
+}
+
+/**
+ * Moves a time of day by a signed number of seconds, wrapping at midnight in either direction.
+ */
+uint32_t AddToTimeOfDay(uint32_t time, int32_t delta_s) {
+    // time + delta_s % day is above -day, so adding a day keeps the dividend positive
+    int32_t shifted = (int32_t)time + delta_s % (int32_t)SECONDS_PER_DAY + (int32_t)SECONDS_PER_DAY;
+    return (uint32_t)shifted % SECONDS_PER_DAY;
+}
+
+/**
+ * Publishes a new time of day in one store and puts the dots in phase with its seconds.
+ * The sub-second phase is left alone.
+ */
+void SetTimeOfDay(uint32_t time) {
+    time_of_day = time;
+    dots_on = (time & 1) ? 0 : 1;
+}
+
+/**
+ * Completion of the boot-time burst: restores the settings, and starts the RTC at 11:11 AM
+ * if its oscillator was halted.
+ */
+void InitReadComplete(uint8_t status, const uint8_t *data) {
+    if (status == 0 && DecodeSettings(&data[NVRAM_SETTINGS_ADDRESS])) {
+        for (uint8_t i = 0; i < NVRAM_SETTINGS_SIZE; i++) {
+            settings_shadow[i] = data[NVRAM_SETTINGS_ADDRESS + i];
+        }
+        boot_stats.settings_restored = 1;
+    }
+    
+    uint32_t rtc_time = (status == 0) ? DecodeTimeRegisters(data) : TIME_INVALID;
+    
+    if (status != 0) {
+        SetTimeOfDay(TIME_OF_DAY(12, 12, 0));
+    } else if ((data[0] & 0x80) || rtc_time == TIME_INVALID) {
+        // Halted or corrupt: start over from a known time
+        SetTimeOfDay(TIME_OF_DAY(11, 11, 0));
+        WriteTimeToDS1307(); // Also clears the CH bit
+    } else {
+        SetTimeOfDay(rtc_time);
+    }
+    boot_stats.restore_cycles = DWT->CYCCNT;
+    MarkDisplayDirty(DIRTY_DIGITS | DIRTY_DOTS);
+    PostEvent(EVENT_SCHEDULE);
+}
+
+/**
+ * Reads the time registers and the settings block in a single burst (completes in InitReadComplete).
+ */
+void InitializeDS1307(void) {
+    PostDS1307Request(0, 0x00, NULL, NVRAM_SETTINGS_ADDRESS + NVRAM_SETTINGS_SIZE, InitReadComplete);
+#if (OCCUPANCY_NVRAM)
+    PostDS1307Request(0, NVRAM_OCCUPANCY_ADDRESS, NULL, 24, OccupancyReadComplete); // Off the boot path
+#endif
+    PostDS1307Request(0, NVRAM_SCHEDULE_ADDRESS, NULL, SCHEDULE_ENTRIES * SCHEDULE_ENTRY_SIZE, ScheduleReadComplete);
+}
+
+/**
+ * Restores the occupancy averages. Out-of-range bytes (never written) read as zero.
+ */
+void OccupancyReadComplete(uint8_t status, const uint8_t *data) {
+    if (status != 0) {
+        return;
+    }
+    for (uint8_t i = 0; i < 24; i++) {
+        occupancy_average[i] = (data[i] <= 60) ? data[i] : 0;
+    }
+}
+
+/**
+ * Restores the schedule table. Entries with an out-of-range time or action are freed.
+ */
+void ScheduleReadComplete(uint8_t status, const uint8_t *data) {
+    if (status != 0) {
+        return;
+    }
+    for (uint8_t i = 0; i < SCHEDULE_ENTRIES; i++) {
+        const uint8_t *entry = &data[i * SCHEDULE_ENTRY_SIZE];
+        uint8_t valid = (entry[0] & 0xF0) == SCHEDULE_TAG && (entry[0] & 0x0F) <= SCHEDULE_HOLD_DISPLAY &&
+                        entry[1] < 24 && entry[2] < 60;
+        for (uint8_t j = 0; j < SCHEDULE_ENTRY_SIZE; j++) {
+            schedule[i][j] = valid ? entry[j] : 0;
+        }
+    }
+    schedule_rescan = 1;
+    PostEvent(EVENT_SCHEDULE);
+}
+
+/**
+ * Encodes the persistent settings into an NVRAM block.
+ */
+void EncodeSettings(uint8_t *block) {
+    uint16_t timeout_s = (uint16_t)(display_timeout_ms / 1000);
+    uint8_t checksum = 0;
+    
+    block[0] = SETTINGS_MAGIC;
+    block[1] = brightness_level;
+    block[2] = fade_curve;
+    block[3] = (uint8_t)(fade_duration_ms / 10);
+    block[4] = (uint8_t)(timeout_s >> 8);
+    block[5] = (uint8_t)timeout_s;
+    block[6] = 0;
+    for (uint8_t i = 0; i < NVRAM_SETTINGS_SIZE - 1; i++) {
+        checksum += block[i];
+    }
+    block[NVRAM_SETTINGS_SIZE - 1] = ~checksum;
+}
+
+/**
+ * Applies an NVRAM settings block. Returns 0 and leaves the defaults if the block is not valid.
+ * The brightness is set directly, without a fade, so the first frame is already at the saved level.
+ */
+uint8_t DecodeSettings(const uint8_t *block) {
+    uint8_t checksum = 0;
+    for (uint8_t i = 0; i < NVRAM_SETTINGS_SIZE - 1; i++) {
+        checksum += block[i];
+    }
+    checksum = ~checksum;
+    
+    uint16_t timeout_s = ((uint16_t)block[4] << 8) | block[5];
+    if (block[0] != SETTINGS_MAGIC || block[NVRAM_SETTINGS_SIZE - 1] != checksum ||
+        block[1] >= BRIGHTNESS_LEVELS || block[2] > FADE_CURVE_EASE_IN_OUT || timeout_s == 0) {
+        return 0;
+    }
+    
+    brightness_level = block[1];
+    current_brightness = brightness_values[brightness_level];
+    target_brightness = current_brightness;
+    current_lightness = brightness_lightness[brightness_level];
+    start_lightness = current_lightness;
+    target_lightness = current_lightness;
+    fade_curve = block[2];
+    fade_duration_ms = (uint16_t)block[3] * 10;
+    display_timeout_ms = (uint32_t)timeout_s * 1000;
+    return 1;
+}
+
+/**
+ * Records a settings change; RtcTask writes it back once the settings have been idle for a while.
+ */
+void MarkSettingsChanged(void) {
+    settings_write_pending = 1;
+    ArmTimer(&settings_flush_timer, SETTINGS_FLUSH_IDLE_MS, 0, EVENT_RTC);
+}
+
+/**
+ * Completion of a settings write: forget the shadow on failure so the block is written again.
+ */
+void SettingsWriteComplete(uint8_t status, const uint8_t *data) {
+    if (status != 0) {
+        settings_shadow[0] = 0xFF;
+        MarkSettingsChanged();
+    }
+}
+
+/**
+ * Writes the settings block to NVRAM if it differs from what the DS1307 holds.
+ */
+void FlushSettingsToDS1307(void) {
+    uint8_t block[NVRAM_SETTINGS_SIZE];
+    uint8_t changed = 0;
+    
+    settings_write_pending = 0;
+    EncodeSettings(block);
+    for (uint8_t i = 0; i < NVRAM_SETTINGS_SIZE; i++) {
+        if (block[i] != settings_shadow[i]) {
+            changed = 1;
+        }
+        settings_shadow[i] = block[i];
+    }
+    
+    if (changed) {
+        PostDS1307Request(1, NVRAM_SETTINGS_ADDRESS, block, NVRAM_SETTINGS_SIZE, SettingsWriteComplete);
+    }
+}
+
+/**
+ * Completion of a resync read: records the software clock drift and adopts the RTC time.
+ * The sub-second phase is kept, so the drift resolution is one second.
+ */
+void TimeReadComplete(uint8_t status, const uint8_t *data) {
+    // Drop the result if the user started setting the time while the read was queued
+    if (status != 0 || time_setting_mode) {
+        return;
+    }
+    
+    uint32_t local_time = time_of_day;
+    uint32_t rtc_time = DecodeTimeRegisters(data);
+    if (rtc_time == TIME_INVALID) {
+        WriteTimeToDS1307(); // Keep the software clock and repair the RTC from it
+        return;
+    }
+    SetTimeOfDay(rtc_time);
+    int32_t drift = (int32_t)rtc_time - (int32_t)local_time;
+    
+    // Wrap into -12h..+12h so a resync across midnight is not seen as a day of drift
+    if (drift >= 43200) {
+        drift -= 86400;
+    } else if (drift < -43200) {
+        drift += 86400;
+    }
+    
+    if (rtc_drift.resync_count == 0 || drift < rtc_drift.min_drift_s) {
+        rtc_drift.min_drift_s = drift;
+    }
+    if (rtc_drift.resync_count == 0 || drift > rtc_drift.max_drift_s) {
+        rtc_drift.max_drift_s = drift;
+    }
+    rtc_drift.last_drift_s = drift;
+    rtc_drift.total_drift_s += drift;
+    rtc_drift.resync_count++;
+    
+    MarkDisplayDirty(DIRTY_DIGITS | DIRTY_DOTS);
+    PostEvent(EVENT_SCHEDULE);
+}
+
+/**
+ * Read time from DS1307 (asynchronous, completes in TimeReadComplete).
+ */
+void ReadTimeFromDS1307(void) {
+    PostDS1307Request(0, 0x00, NULL, 3, TimeReadComplete);
+}
+
+/**
+ * Completion of a time write: re-arm the flush on failure.
+ */
+void TimeWriteComplete(uint8_t status, const uint8_t *data) {
+    if (status != 0) {
+        MarkTimeChanged();
+    }
+}
+
+/**
+ * Write time to DS1307 (asynchronous, the registers are snapshotted when queued).
+ * Returns 0 if the write was not queued; TimeWriteComplete has then re-armed the flush.
+ */
+uint8_t WriteTimeToDS1307(void) {
+    uint8_t buffer[3];
+    
+    uint8_t interrupts = CyEnterCriticalSection();
+    EncodeTimeRegisters(time_of_day, buffer);
+    rtc_write_pending = 0;
+    uint8_t queued = PostDS1307Request(1, 0x00, buffer, 3, TimeWriteComplete);
+    CyExitCriticalSection(interrupts);
+    return queued;
+}
+
+/**
+ * Records a time-setting change in the RAM clock; the DS1307 write is deferred.
+ */
+void MarkTimeChanged(void) {
+    rtc_write_pending = 1;
+    ArmTimer(&rtc_flush_timer, RTC_FLUSH_IDLE_MS, 0, EVENT_RTC);
+}
+
+/**
+ * Writes the pending time to the DS1307. All three registers go out, since the RTC has kept counting
+ * since they were last read or written and any of them may differ from the RAM clock by now.
+ */
+void FlushTimeToDS1307(void) {
+    if (rtc_write_pending) {
+        WriteTimeToDS1307();
+    }
+}
+
+/**
+ * Flags part of the display for re-rendering and wakes DisplayTask. Safe to call from ISRs.
+ */
+void MarkDisplayDirty(uint8_t flags) {
+    uint8_t interrupts = CyEnterCriticalSection();
+    display_dirty |= flags;
+    CyExitCriticalSection(interrupts);
+    PostEvent(EVENT_DISPLAY_DIRTY);
+}
+
+/**
+ * Renders the dirty parts of the time (12-hour format) and dots into the back frame buffer and publishes it.
+ */
+void UpdateDisplayTime(void) {
+    uint8_t interrupts = CyEnterCriticalSection();
+    uint8_t dirty = display_dirty;
+    display_dirty = 0;
+    CyExitCriticalSection(interrupts);
+    
+    if (dirty == 0) {
+        return;
+    }
+    
+    uint8_t back_buffer = front_buffer ^ 1;
+    volatile DisplayFrameSlot *frame = frame_buffers[back_buffer];
+    
+    if (dirty & DIRTY_DIGITS) {
+        uint32_t time = time_of_day; // One snapshot, so the hour and minute cannot tear at a rollover
+        uint8_t hour_bcd = bcd_from_binary[hour12_from_hour24[time / 3600]];
+        uint8_t minute_bcd = bcd_from_binary[(time / 60) % 60];
+        
+        uint8_t glyphs[DISPLAY_DIGITS];
+        
+        if (message_length != 0) {
+            for (uint8_t position = 0; position < DISPLAY_DIGITS; position++) {
+                glyphs[position] = message_segments[message_offset + position];
+            }
+        } else {
+            glyphs[0] = GlyphSegments('0' + (hour_bcd >> 4));
+            glyphs[1] = GlyphSegments('0' + (hour_bcd & 0x0F));
+            glyphs[2] = GlyphSegments('0' + (minute_bcd >> 4));
+            glyphs[3] = GlyphSegments('0' + (minute_bcd & 0x0F));
+#if (DISPLAY_SHOWS_SECONDS)
+            uint8_t second_bcd = bcd_from_binary[time % 60];
+            glyphs[4] = GlyphSegments('0' + (second_bcd >> 4));
+            glyphs[5] = GlyphSegments('0' + (second_bcd & 0x0F));
+#endif
+        }
+        
+        for (uint8_t position = 0; position < DISPLAY_DIGITS; position++) {
+            volatile DisplayFrameSlot *slot = &frame[position];
+            uint8_t segments = glyphs[position];
+            
+            *slot = blank_slot;
+            for (uint8_t i = 0; i < sizeof(digit_slot_outputs); i++) {
+                SetDisplayOutput(slot, digit_slot_outputs[i]);
+            }
+            SetDisplayOutput(slot, digit_grid_outputs[position]);
+            for (uint8_t segment = 0; segment < 7; segment++) {
+                if (segments & (1 << segment)) {
+                    SetDisplayOutput(slot, segment_outputs[segment]);
+                }
+            }
+        }
+        render_stats.full_renders++;
+    } else {
+        // Digits unchanged: carry them over from the front frame
+        const volatile DisplayFrameSlot *front = frame_buffers[front_buffer];
+        for (uint8_t position = 0; position < DISPLAY_DIGITS; position++) {
+            frame[position] = front[position];
+        }
+        render_stats.dots_renders++;
+    }
+    
+    frame[DOTS_SLOT] = blank_slot;
+    if ((dots_on || rtc_degraded_shown) && message_length == 0) {
+        for (uint8_t i = 0; i < sizeof(dots_outputs); i++) {
+            SetDisplayOutput(&frame[DOTS_SLOT], dots_outputs[i]);
+        }
+    }
+    
+#if (DISPLAY_REFRESH_DMA)
+    // Close the new chain on itself, then divert the running chain into it at the end of its frame
+    CyDmaTdSetConfiguration(dma_refresh_tds[back_buffer][DISPLAY_SLOTS - 1], sizeof(DisplayFrameSlot),
+                            dma_refresh_tds[back_buffer][0], TD_INC_SRC_ADR);
+    CyDmaTdSetConfiguration(dma_refresh_tds[front_buffer][DISPLAY_SLOTS - 1], sizeof(DisplayFrameSlot),
+                            dma_refresh_tds[back_buffer][0], TD_INC_SRC_ADR);
+#endif
+    
+    // Single-byte store: the multiplex ISR picks up the new frame on its next slot
+    front_buffer = back_buffer;
+    
+#if (SERIAL_PROTOCOL)
+    if (serial_streaming) {
+        SendDisplayFrame();
+    }
+#endif
+}
+
+#if (DISPLAY_REFRESH_DMA)
+/**
+ * Sets up DMA_Refresh to stream the front frame into SPIM_1, one slot per Timer_1 terminal count.
+ * The old frame can still be in flight for up to one frame period after a publish, which is far
+ * shorter than the interval between renders.
+ */
+void InitializeDisplayDMA(void) {
+    dma_refresh_channel = DMA_Refresh_DmaInitialize(DMA_REFRESH_BURST_BYTES, 0,
+                                                    HI16(CYDEV_SRAM_BASE), HI16(CYDEV_PERIPH_BASE));
+    
+    for (uint8_t buffer = 0; buffer < 2; buffer++) {
+        for (uint8_t position = 0; position < DISPLAY_SLOTS; position++) {
+            dma_refresh_tds[buffer][position] = CyDmaTdAllocate();
+        }
+    }
+    
+    for (uint8_t buffer = 0; buffer < 2; buffer++) {
+        for (uint8_t position = 0; position < DISPLAY_SLOTS; position++) {
+            uint8_t next = (position + 1 < DISPLAY_SLOTS) ? position + 1 : 0;
+            CyDmaTdSetConfiguration(dma_refresh_tds[buffer][position], sizeof(DisplayFrameSlot),
+                                    dma_refresh_tds[buffer][next], TD_INC_SRC_ADR);
+            CyDmaTdSetAddress(dma_refresh_tds[buffer][position],
+                              LO16((uint32)&frame_buffers[buffer][position]), LO16((uint32)SPIM_1_TXDATA_PTR));
+        }
+    }
+    
+    CyDmaChSetInitialTd(dma_refresh_channel, dma_refresh_tds[front_buffer][0]);
+    CyDmaChEnable(dma_refresh_channel, 1); // Preserve the TDs so the chain can loop
+}
+#endif
+
+/**
+ * Sends one pre-encoded slot of the front frame to the MAX6920s.
+ */
+void DisplayMultiplexed(uint8_t position) {
+    LatchDisplaySlot(&frame_buffers[front_buffer][position]);
+    telemetry.spi_frames++;
+}
+
+/**
+ * Sets one MAX6920 output in a slot.
+ */
+void SetDisplayOutput(volatile DisplayFrameSlot *slot, uint8_t output) {
+    slot->words[DISPLAY_CHAIN_LENGTH - 1 - output / MAX6920_OUTPUTS] |= (uint16_t)(1 << (output % MAX6920_OUTPUTS));
+}
+
+/**
+ * Shifts one slot (one word per chip) into the MAX6920 chain and latches it.
+ */
+void LatchDisplaySlot(const volatile DisplayFrameSlot *slot) {
+    SPIM_1_ClearTxBuffer();
+    SPIM_1_ClearRxBuffer();
+    
+#if (!DISPLAY_REFRESH_DMA)
+    Pin_LOAD_Write(0);
+#endif
+    
+    for (uint8_t chip = 0; chip < DISPLAY_CHAIN_LENGTH; chip++) {
+#if (DISPLAY_CHAIN_LENGTH > SPIM_1_TX_BUFFER_SIZE)
+        // Longer chains than the TX FIFO wait for room
+        while (!(SPIM_1_ReadTxStatus() & SPIM_1_STS_TX_FIFO_NOT_FULL));
+#endif
+        SPIM_1_WriteTxData(slot->words[chip]);
+    }
+    
+    while (!(SPIM_1_ReadStatus() & SPIM_1_STS_SPI_DONE));
+    
+    // In DMA mode LOAD follows SPIM_1's ss, so the latch happens in hardware
+#if (!DISPLAY_REFRESH_DMA)
+    Pin_LOAD_Write(1);
+    CyDelayUs(5);
+    Pin_LOAD_Write(0);
+#endif
+    
+#if (DISPLAY_TRACE)
+    RecordDisplayTrace(slot);
+#endif
+}
+
+/**
+ * Blanks the display: stops the refresh and latches all MAX6920 outputs off.
+ * Nothing is shifted out again until WakeDisplay().
+ */
+void BlankDisplay(void) {
+    uint8_t interrupts = CyEnterCriticalSection(); // The PIR ISR may wake the display
+    
+    PWM_2_WriteCompare(0);
+    display_on = 0;
+    
+#if (DISPLAY_REFRESH_DMA)
+    CyDmaChDisable(dma_refresh_channel);
+#else
+    isr_1_Disable();
+#endif
+    Timer_1_Stop();
+    
+    LatchDisplaySlot(&blank_slot);
+    CyExitCriticalSection(interrupts);
+}
+
+/**
+ * Restarts the refresh from slot 0 of the current frame and turns the display on.
+ */
+void WakeDisplay(void) {
+    uint8_t interrupts = CyEnterCriticalSection();
+    
+    current_digit = 0;
+    
+#if (DISPLAY_REFRESH_DMA)
+    CyDmaChSetInitialTd(dma_refresh_channel, dma_refresh_tds[front_buffer][0]);
+    CyDmaChEnable(dma_refresh_channel, 1);
+#else
+    isr_1_ClearPending();
+    isr_1_Enable();
+#endif
+    Timer_1_Start();
+    
+    PWM_2_WriteCompare(current_brightness);
+    display_on = 1;
+    CyExitCriticalSection(interrupts);
+}
+
+/**
+ * Multiplexes the four digits and the dots.
+ */
+void MultiplexDisplay(void) {
+    DisplayMultiplexed(current_digit);
+    if (++current_digit >= DISPLAY_SLOTS) {
+        current_digit = 0;
+        if (boot_stats.first_frame_cycles == 0 && boot_stats.publish_cycles != 0) {
+            boot_stats.first_frame_cycles = DWT->CYCCNT;
+        }
+    }
+}
+
+/**
+ * Timer_1 interrupt handler for multiplexing.
+ */
+CY_ISR(MultplexInterruptHandler) {
+    ISR_PROFILE_ENTER(ISR_ID_MULTIPLEX);
+    Timer_1_ReadStatusRegister();
+    MultiplexDisplay();
+    ISR_PROFILE_EXIT(ISR_ID_MULTIPLEX);
+}
+
+#if (ISR_PROFILING)
+/**
+ * Folds one ISR run into its statistics and the trace ring. Called at ISR exit.
+ */
+void RecordIsrProfile(uint8_t id, uint32_t entry) {
+    uint32_t cycles = DWT->CYCCNT - entry;
+    volatile IsrProfile *profile = &isr_profiles[id];
+    
+    if (profile->count == 0 || cycles < profile->min_cycles) {
+        profile->min_cycles = cycles;
+    }
+    if (cycles > profile->max_cycles) {
+        profile->max_cycles = cycles;
+    }
+    if (profile->count != 0) {
+        uint32_t period = entry - profile->last_entry;
+        if (profile->count == 1 || period < profile->min_period) {
+            profile->min_period = period;
+        }
+        if (period > profile->max_period) {
+            profile->max_period = period;
+        }
+    }
+    profile->last_entry = entry;
+    profile->total_cycles += cycles;
+    profile->count++;
+    
+    // log2 bucket: CLZ is a single instruction on the Cortex-M3
+    uint8_t bucket = (cycles < 16) ? 0 : (uint8_t)(28 - __CLZ(cycles));
+    if (bucket >= ISR_HISTOGRAM_BUCKETS) {
+        bucket = ISR_HISTOGRAM_BUCKETS - 1;
+    }
+    profile->histogram[bucket]++;
+    
+    volatile IsrTraceSample *sample = &isr_trace[isr_trace_head];
+    sample->id = id;
+    sample->entry = entry;
+    sample->cycles = cycles;
+    isr_trace_head = (isr_trace_head + 1) & (ISR_TRACE_DEPTH - 1);
+}
+
+/**
+ * Copies one ISR's statistics with interrupts masked so the snapshot is consistent.
+ * Returns 0 for an unknown id.
+ */
+uint8_t ReadIsrProfile(uint8_t id, IsrProfile *snapshot) {
+    if (id >= ISR_PROFILE_COUNT) {
+        return 0;
+    }
+    uint8_t interrupts = CyEnterCriticalSection();
+    *snapshot = isr_profiles[id];
+    CyExitCriticalSection(interrupts);
+    return 1;
+}
+#endif
+
+#if (DISPLAY_TRACE)
+/**
+ * Appends a latched slot to the trace ring. Called from LatchDisplaySlot.
+ */
+void RecordDisplayTrace(const volatile DisplayFrameSlot *slot) {
+    if (display_trace_frozen) {
+        return;
+    }
+    
+    uint8_t interrupts = CyEnterCriticalSection(); // Blanking latches from the main loop too
+    volatile DisplayTraceSample *sample = &display_trace[display_trace_head & (DISPLAY_TRACE_DEPTH - 1)];
+    sample->timestamp = DWT->CYCCNT;
+    sample->slot = *slot;
+    display_trace_head++;
+    CyExitCriticalSection(interrupts);
+}
+
+/**
+ * Returns 1 if the output is driven in the slot. The inverse of SetDisplayOutput.
+ */
+uint8_t TestDisplayOutput(const volatile DisplayFrameSlot *slot, uint8_t output) {
+    return (slot->words[DISPLAY_CHAIN_LENGTH - 1 - output / MAX6920_OUTPUTS] >> (output % MAX6920_OUTPUTS)) & 1;
+}
+
+/**
+ * Analyses the trace ring: each sample's outputs stay on until the next latch. Returns 0 if there
+ * are too few samples. Recording pauses while this runs, so call it from the main loop.
+ */
+uint8_t AnalyzeDisplayTrace(DisplayTraceReport *report) {
+    uint8_t grid_outputs[DISPLAY_GRIDS];
+    uint32_t last_rise[DISPLAY_GRIDS];
+    uint32_t last_fall[DISPLAY_GRIDS];
+    uint32_t min_period[DISPLAY_GRIDS];
+    uint32_t max_period[DISPLAY_GRIDS];
+    uint16_t rises[DISPLAY_GRIDS];
+    uint8_t lit[DISPLAY_GRIDS];
+    
+    for (uint8_t grid = 0; grid < DISPLAY_DIGITS; grid++) {
+        grid_outputs[grid] = digit_grid_outputs[grid];
+    }
+    // The dots' own output; the first one is shared with the digit slots
+    grid_outputs[DISPLAY_DIGITS] = dots_outputs[sizeof(dots_outputs) - 1];
+    
+    display_trace_frozen = 1;
+    
+    uint32_t head = display_trace_head;
+    uint32_t count = (head < DISPLAY_TRACE_DEPTH) ? head : DISPLAY_TRACE_DEPTH;
+    if (count < 2) {
+        display_trace_frozen = 0;
+        return 0;
+    }
+    
+    for (uint8_t grid = 0; grid < DISPLAY_GRIDS; grid++) {
+        report->on_cycles[grid] = 0;
+        report->worst_gap_cycles[grid] = 0;
+        min_period[grid] = UINT32_MAX;
+        max_period[grid] = 0;
+        rises[grid] = 0;
+        lit[grid] = 0;
+        last_rise[grid] = 0; // Only read once rises is non-zero
+        last_fall[grid] = 0;
+    }
+    
+    uint32_t first = head - count;
+    uint32_t start = display_trace[first & (DISPLAY_TRACE_DEPTH - 1)].timestamp;
+    
+    for (uint32_t i = first; i != head - 1; i++) {
+        const volatile DisplayTraceSample *sample = &display_trace[i & (DISPLAY_TRACE_DEPTH - 1)];
+        uint32_t now = sample->timestamp;
+        uint32_t interval = display_trace[(i + 1) & (DISPLAY_TRACE_DEPTH - 1)].timestamp - now;
+        
+        for (uint8_t grid = 0; grid < DISPLAY_GRIDS; grid++) {
+            uint8_t on = TestDisplayOutput(&sample->slot, grid_outputs[grid]);
+            
+            if (on) {
+                report->on_cycles[grid] += interval;
+                if (!lit[grid]) {
+                    if (rises[grid] != 0) {
+                        uint32_t period = now - last_rise[grid];
+                        uint32_t gap = now - last_fall[grid];
+                        if (period < min_period[grid]) {
+                            min_period[grid] = period;
+                        }
+                        if (period > max_period[grid]) {
+                            max_period[grid] = period;
+                        }
+                        if (gap > report->worst_gap_cycles[grid]) {
+                            report->worst_gap_cycles[grid] = gap;
+                        }
+                    }
+                    last_rise[grid] = now;
+                    rises[grid]++;
+                }
+            } else if (lit[grid]) {
+                last_fall[grid] = now;
+            }
+            lit[grid] = on;
+        }
+    }
+    
+    report->span_cycles = display_trace[(head - 1) & (DISPLAY_TRACE_DEPTH - 1)].timestamp - start;
+    display_trace_frozen = 0;
+    if (report->span_cycles == 0) {
+        return 0;
+    }
+    
+    uint32_t span_ms = report->span_cycles / (BCLK__BUS_CLK__HZ / 1000);
+    report->refresh_millihz = (span_ms != 0) ? (uint32_t)rises[0] * 1000000UL / span_ms : 0;
+    
+    for (uint8_t grid = 0; grid < DISPLAY_GRIDS; grid++) {
+        report->duty_permille[grid] = (uint16_t)((uint64_t)report->on_cycles[grid] * 1000 / report->span_cycles);
+        if (max_period[grid] != 0) {
+            report->flicker_permille[grid] = (uint16_t)((uint64_t)(max_period[grid] - min_period[grid]) * 1000 /
+                                                        (max_period[grid] + min_period[grid]));
+        } else {
+            report->flicker_permille[grid] = 0;
+        }
+    }
+    return 1;
+}
+#endif
+
+/**
+ * Copies the telemetry counters with interrupts masked, so the snapshot is consistent.
+ */
+void ReadTelemetry(Telemetry *snapshot) {
+    uint8_t interrupts = CyEnterCriticalSection();
+    *snapshot = telemetry;
+    CyExitCriticalSection(interrupts);
+}
+
+/**
+ * Scales the energy model by the observed on-time and PWM duty, extrapolated to a full day.
+ */
+void EstimateEnergy(const Telemetry *snapshot, EnergyEstimate *estimate) {
+    uint64_t total_ms = (uint64_t)snapshot->display_on_ms + snapshot->display_off_ms;
+    uint64_t duty_ms = 0; // Display-on time weighted by PWM duty (x255)
+    
+    for (uint8_t level = 0; level < BRIGHTNESS_LEVELS; level++) {
+        duty_ms += (uint64_t)snapshot->level_ms[level] * brightness_values[level];
+    }
+    
+    if (total_ms == 0) {
+        estimate->filament_mwh_per_day = 0;
+        estimate->grid_mwh_per_day = 0;
+        estimate->average_duty_permille = 0;
+        estimate->on_time_permille = 0;
+        return;
+    }
+    
+    estimate->filament_mwh_per_day = FILAMENT_POWER_MW * 24;
+    estimate->grid_mwh_per_day = (uint32_t)((uint64_t)GRID_POWER_MW * 24 * duty_ms / (total_ms * 255));
+    estimate->on_time_permille = (uint16_t)((uint64_t)snapshot->display_on_ms * 1000 / total_ms);
+    estimate->average_duty_permille = (snapshot->display_on_ms != 0) ?
+        (uint16_t)(duty_ms * 1000 / ((uint64_t)snapshot->display_on_ms * 255)) : 0;
+}
+
+/**
+ * Posts scheduler events and lets an idle main loop resume. Safe to call from ISRs.
+ */
+void PostEvent(uint16_t events) {
+    if (events == 0) {
+        return;
+    }
+    uint8_t interrupts = CyEnterCriticalSection();
+    pending_events |= events;
+    SCB->SCR &= ~SCB_SCR_SLEEPONEXIT_Msk; // The handler returns to RunScheduler instead of sleeping
+    CyExitCriticalSection(interrupts);
+}
+
+/**
+ * Registers a task that runs every period_ms (0 = never periodically) and whenever one of its events is posted.
+ */
+void RegisterTask(void (*run)(void), uint32_t period_ms, uint16_t events) {
+    if (task_count >= MAX_TASKS) {
+        return;
+    }
+    Task *task = &tasks[task_count++];
+    task->run = run;
+    task->events = events;
+    task->run_count = 0;
+    task->busy_cycles = 0;
+    if (period_ms != 0) {
+        ArmTimer(&task->timer, period_ms, period_ms, EVENT_TASK_TIMER);
+    }
+}
+
+/**
+ * Adds an armed timer to its wheel slot. Called with interrupts masked.
+ */
+void LinkTimer(SoftTimer *timer) {
+    SoftTimer **slot = &timer_wheel[timer->expiry & (TIMER_WHEEL_SLOTS - 1)];
+    
+    timer->prev = NULL;
+    timer->next = *slot;
+    if (*slot != NULL) {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+}
+
+/**
+ * Removes a timer from its wheel slot. Called with interrupts masked.
+ */
+void UnlinkTimer(SoftTimer *timer) {
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        timer_wheel[timer->expiry & (TIMER_WHEEL_SLOTS - 1)] = timer->next;
+    }
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+}
+
+/**
+ * Arms (or re-arms) a timer to fire after delay_ms, then every period_ms (0 = one-shot).
+ * Safe from ISRs and the main loop.
+ */
+void ArmTimer(SoftTimer *timer, uint32_t delay_ms, uint32_t period_ms, uint16_t events) {
+    uint8_t interrupts = CyEnterCriticalSection();
+    
+    if (timer->armed) {
+        UnlinkTimer(timer);
+    } else {
+        timer->armed = 1;
+        timer_count++;
+    }
+    
+    timer->expiry = tick_count + ((delay_ms != 0) ? delay_ms : 1); // Never in the tick already processed
+    timer->period_ms = period_ms;
+    timer->events = events;
+    timer->fired = 0;
+    LinkTimer(timer);
+    
+    if (timer_count == 1 || (int32_t)(timer->expiry - timer_next_deadline) < 0) {
+        timer_next_deadline = timer->expiry;
+    }
+    CyExitCriticalSection(interrupts);
+}
+
+/**
+ * Stops a timer. Leaves timer_next_deadline as it is; a stale bound only costs one wheel scan.
+ */
+void CancelTimer(SoftTimer *timer) {
+    uint8_t interrupts = CyEnterCriticalSection();
+    if (timer->armed) {
+        UnlinkTimer(timer);
+        timer->armed = 0;
+        timer_count--;
+    }
+    timer->fired = 0;
+    CyExitCriticalSection(interrupts);
+}
+
+/**
+ * Returns 1 and clears the flag if the timer has fired since it was armed or last taken.
+ */
+uint8_t TakeTimerFired(SoftTimer *timer) {
+    uint8_t interrupts = CyEnterCriticalSection();
+    uint8_t fired = timer->fired;
+    timer->fired = 0;
+    CyExitCriticalSection(interrupts);
+    return fired;
+}
+
+/**
+ * Fires the timers due on this tick and recomputes the next deadline. Runs from the tick ISR.
+ */
+void ProcessTimers(void) {
+    uint32_t now = tick_count;
+    
+    if (timer_count == 0 || (int32_t)(now - timer_next_deadline) < 0) {
+        return;
+    }
+    
+    // Later laps share the slot, so each timer is checked against its own expiry
+    SoftTimer *timer = timer_wheel[now & (TIMER_WHEEL_SLOTS - 1)];
+    while (timer != NULL) {
+        SoftTimer *next = timer->next;
+        if ((int32_t)(now - timer->expiry) >= 0) {
+            UnlinkTimer(timer);
+            timer->fired = 1;
+            if (timer->period_ms != 0) {
+                timer->expiry += timer->period_ms; // Keeps the phase, so periodic timers do not drift
+                LinkTimer(timer);
+            } else {
+                timer->armed = 0;
+                timer_count--;
+            }
+            PostEvent(timer->events);
+        }
+        timer = next;
+    }
+    
+    // New lower bound: the earliest expiry still armed
+    int32_t earliest = INT32_MAX;
+    for (uint8_t i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+        for (timer = timer_wheel[i]; timer != NULL; timer = timer->next) {
+            int32_t delta = (int32_t)(timer->expiry - now);
+            if (delta < earliest) {
+                earliest = delta;
+            }
+        }
+    }
+    timer_next_deadline = now + (uint32_t)earliest;
+}
+
+/**
+ * Enables the DWT cycle counter used for the scheduler statistics.
+ */
+void StartCycleCounter(void) {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+/**
+ * Runs due tasks, then sleeps in WFI until the next interrupt. Never returns.
+ */
+void RunScheduler(void) {
+    scheduler_stats.window_start = DWT->CYCCNT;
+    ArmTimer(&scheduler_stats_timer, SCHEDULER_STATS_MS, SCHEDULER_STATS_MS, EVENT_SCHEDULER_STATS);
+    
+    for (;;) {
+        uint8_t interrupts = CyEnterCriticalSection();
+        uint16_t events = pending_events;
+        pending_events = 0;
+        CyExitCriticalSection(interrupts);
+        
+        for (uint8_t i = 0; i < task_count; i++) {
+            Task *task = &tasks[i];
+            uint8_t due = ((events & EVENT_TASK_TIMER) != 0) && TakeTimerFired(&task->timer);
+            
+            if (due || (events & task->events)) {
+                uint32_t start = DWT->CYCCNT;
+                task->run();
+                task->busy_cycles += DWT->CYCCNT - start;
+                task->run_count++;
+            }
+        }
+        
+        if ((events & EVENT_SCHEDULER_STATS) && TakeTimerFired(&scheduler_stats_timer)) {
+            uint32_t window = DWT->CYCCNT - scheduler_stats.window_start;
+            scheduler_stats.cpu_utilisation_permille = 1000 - scheduler_stats.idle_cycles / (window / 1000);
+            scheduler_stats.idle_cycles = 0;
+            scheduler_stats.window_start = DWT->CYCCNT;
+        }
+        
+        // With PRIMASK set, a pending interrupt still ends WFI but its handler runs after __enable_irq().
+        // Sleep-on-exit then puts the core back to sleep after every handler that posts no event, so
+        // the tick and the refresh no longer bring the loop round; PostEvent clears it to resume.
+        __disable_irq();
+        if (pending_events == 0) {
+            uint32_t idle_start = DWT->CYCCNT;
+            SCB->SCR |= SCB_SCR_SLEEPONEXIT_Msk;
+            __WFI();
+            __enable_irq(); // Handlers run here, asleep in between, until one posts an event
+            scheduler_stats.idle_cycles += DWT->CYCCNT - idle_start; // Includes those handlers
+        }
+        __enable_irq();
+    }
+}
+
+/**
+ * Starts a fade from the current lightness to the given brightness level.
+ */
+void StartFade(uint8_t level) {
+    start_lightness = current_lightness;
+    target_lightness = brightness_lightness[level];
+    target_brightness = brightness_values[level];
+    fade_rate_q16 = (fade_duration_ms != 0) ? 65536UL / fade_duration_ms : 65536UL;
+    fade_start_time = tick_count;
+    fading = 1;
+    telemetry.fades++;
+    if (!fade_timer.armed) {
+        ArmTimer(&fade_timer, FADE_STEP_MS, FADE_STEP_MS, EVENT_FADE_STEP);
+    }
+}
+
+/**
+ * Applies the easing curve to a fade progress (Q8, 0-256).
+ */
+uint16_t EaseFade(uint16_t progress) {
+    switch (fade_curve) {
+        case FADE_CURVE_EASE_OUT:
+            return (uint16_t)(((uint32_t)progress * (512 - progress)) >> 8);
+        case FADE_CURVE_EASE_IN_OUT:
+            return (uint16_t)(((uint32_t)progress * progress * (768 - 2 * progress)) >> 16);
+        default:
+            return progress;
+    }
+}
+
+/**
+ * Steps the brightness fade in Q8 fixed point and maps the lightness through the gamma table.
+ */
+void FadeTask(void) {
+    if (!fading) {
+        return;
+    }
     
-    while (!(SPIM_1_ReadStatus() & SPIM_1_STS_SPI_DONE));
+    uint32_t elapsed_time = tick_count - fade_start_time;
     
-    Pin_LOAD_Write(1);
-    CyDelayUs(5);
-    Pin_LOAD_Write(0);
+    // Check if fade is complete
+    if (elapsed_time >= fade_duration_ms) {
+        current_lightness = target_lightness;
+        current_brightness = target_brightness; // Land exactly on the level's duty cycle
+        PWM_2_WriteCompare(display_on ? current_brightness : 0);
+        fading = 0; // Stop fading
+        CancelTimer(&fade_timer);
+    }
+    // Update brightness incrementally
+    else {
+        uint32_t progress = (elapsed_time * fade_rate_q16) >> 8;
+        if (progress > 256) {
+            progress = 256;
+        }
+        uint16_t eased = EaseFade((uint16_t)progress);
+        
+        // Weighted blend keeps the arithmetic unsigned in both directions
+        current_lightness = (uint8_t)(((uint32_t)start_lightness * (256 - eased) +
+                                       (uint32_t)target_lightness * eased) >> 8);
+        
+        // Slow fades repeat duty cycles; only touch PWM_2 when the value moves
+        uint8_t brightness = gamma_table[current_lightness];
+        if (brightness == current_brightness) {
+            render_stats.pwm_writes_avoided++;
+            return;
+        }
+        current_brightness = brightness;
+        PWM_2_WriteCompare(display_on ? current_brightness : 0);
+    }
 }
 
 /**
- * Multiplexes the four digits and the dots.
+ * Segment pattern for a character; anything outside the table is blank.
  */
-void MultiplexDisplay(void) {
-    DisplayMultiplexed(current_digit);
-    current_digit = (current_digit + 1) % 5;
+uint8_t GlyphSegments(char c) {
+    uint8_t index = (uint8_t)c - GLYPH_FIRST;
+    return (index < GLYPH_COUNT) ? glyph_segments[index] : 0;
 }
 
 /**
- * Timer_1 interrupt handler for multiplexing.
+ * Replaces the digits with a message. Text that fits is shown left-aligned for duration_ms;
+ * longer text scrolls through once at MESSAGE_SCROLL_MS per step. Main loop only.
  */
-CY_ISR(MultplexInterruptHandler) {
-    Timer_1_ReadStatusRegister();
-    MultiplexDisplay();
+void ShowMessage(const char *text, uint16_t duration_ms) {
+    uint8_t length = 0;
+    while (length < MESSAGE_MAX && text[length] != '\0') {
+        length++;
+    }
+    
+    for (uint8_t i = 0; i < sizeof(message_segments); i++) {
+        message_segments[i] = 0;
+    }
+    
+    if (length <= DISPLAY_DIGITS) {
+        for (uint8_t i = 0; i < length; i++) {
+            message_segments[i] = GlyphSegments(text[i]);
+        }
+        message_length = DISPLAY_DIGITS;
+        message_offset = 0;
+        message_scrolling = 0;
+        ArmTimer(&message_timer, duration_ms, 0, EVENT_MESSAGE);
+    } else {
+        // Enters from the right and leaves to the left
+        for (uint8_t i = 0; i < length; i++) {
+            message_segments[DISPLAY_DIGITS + i] = GlyphSegments(text[i]);
+        }
+        message_length = DISPLAY_DIGITS + length + DISPLAY_DIGITS;
+        message_offset = 1;
+        message_scrolling = 1;
+        ArmTimer(&message_timer, MESSAGE_SCROLL_MS, MESSAGE_SCROLL_MS, EVENT_MESSAGE);
+    }
+    MarkDisplayDirty(DIRTY_DIGITS | DIRTY_DOTS);
 }
 
 /**
- * Main function.
+ * Moves a scrolling message on by one digit, or ends the message when it is done.
  */
-int main(void) {
-    CyGlobalIntEnable;
+void AdvanceMessage(void) {
+    if (message_scrolling && message_offset + DISPLAY_DIGITS < message_length) {
+        message_offset++;
+        MarkDisplayDirty(DIRTY_DIGITS);
+        return;
+    }
+    ClearMessage();
+}
+
+/**
+ * Returns the display to the clock.
+ */
+void ClearMessage(void) {
+    CancelTimer(&message_timer);
+    if (message_length != 0) {
+        message_length = 0;
+        MarkDisplayDirty(DIRTY_DIGITS | DIRTY_DOTS);
+    }
+}
+
+/**
+ * Renders the display when something visible changed.
+ */
+void DisplayTask(void) {
+    if (TakeTimerFired(&message_timer)) {
+        AdvanceMessage();
+    }
     
-    SPIM_1_Start();
-    PWM_1_Start();
-    PWM_2_Start();
-    Timer_1_Start();
-    Timer_3_Start();
-    I2C_1_Start();
+    if (i2c_error != i2c_error_shown) {
+        i2c_error_shown = i2c_error;
+        if (i2c_error_shown) {
+            ShowMessage("Err", MESSAGE_ERROR_MS);
+        }
+    }
     
-    // Initially turn off the display
-    PWM_2_WriteCompare(0);
-    display_on = 0;
+    // Degraded RTC: scroll a notice once, then hold the dots steady until it recovers
+    uint8_t degraded = (rtc_health.state != RTC_HEALTHY) ? 1 : 0;
+    if (degraded != rtc_degraded_shown) {
+        rtc_degraded_shown = degraded;
+        if (degraded) {
+            ShowMessage("no rtc", MESSAGE_ERROR_MS);
+        }
+        MarkDisplayDirty(DIRTY_DOTS);
+    }
     
-    CyDelay(10);
+    UpdateDisplayTime();
     
-    isr_1_StartEx(MultplexInterruptHandler);
-    isr_3_StartEx(ButtonPressInterruptHandler);
-    isr_4_StartEx(UpButtonPressInterruptHandler);
-    isr_5_StartEx(DownButtonPressInterruptHandler);
-    isr_6_StartEx(TickInterruptHandler);
+    // The first frame after the boot burst goes straight to the display at the restored brightness.
+    // The refresh restarts at slot 0, so the first complete pass is this frame.
+    if (boot_stats.publish_cycles == 0 && boot_stats.restore_cycles != 0) {
+        uint8_t was_on = display_on;
+        uint8_t interrupts = CyEnterCriticalSection();
+        boot_stats.publish_cycles = DWT->CYCCNT;
+        WakeDisplay();
+#if (DISPLAY_REFRESH_DMA)
+        boot_stats.first_frame_cycles = boot_stats.publish_cycles; // Latched in hardware, within a frame
+#endif
+        CyExitCriticalSection(interrupts);
+        if (!was_on) {
+            ArmTimer(&display_timer, display_timeout_ms, 0, EVENT_DISPLAY_TIMEOUT);
+        }
+    }
+}
+
+/**
+ * Resyncs the software clock with the DS1307 and flushes idle time-setting and settings changes.
+ * Also runs the RTC breaker's transaction watchdog and its recovery probes.
+ */
+void RtcTask(void) {
+    AbortDS1307Request(); // Only if the watchdog fired
     
-    uint8_t initialized = 0;
-    i2c_error = 0;
-    InitializeDS1307(&initialized);
-    if (i2c_error) {
-        hours = 12;
-        minutes = 12;
-        seconds = 0;
-        i2c_error = 0;
+    // Half-open: clear a possibly stuck bus, then let one resync read decide
+    if (TakeTimerFired(&rtc_probe_timer) && rtc_health.state == RTC_OPEN) {
+        RecoverI2CBus();
+        rtc_health.state = RTC_HALF_OPEN;
+        ReadTimeFromDS1307();
+    }
+    
+    if (TakeTimerFired(&rtc_resync_timer) && !time_setting_mode) {
+        ReadTimeFromDS1307();
+    }
+    
+    // Flush time-setting changes once they have been idle for a while
+    if (TakeTimerFired(&rtc_flush_timer)) {
+        FlushTimeToDS1307();
+    }
+    
+    if (TakeTimerFired(&settings_flush_timer) && settings_write_pending) {
+        FlushSettingsToDS1307();
+    }
+}
+
+/**
+ * Brightness button: step to the next level. A press during a fade retargets it from the current lightness.
+ */
+void HandleBrightnessPress(void) {
+    // Increase brightness level, loop back to min if at maximum
+    if (brightness_level >= BRIGHTNESS_LEVELS - 1) {
+        brightness_level = 0; // Loop back to min brightness
+    } else {
+        brightness_level++;
+    }
+    
+    StartFade(brightness_level);
+    MarkSettingsChanged();
+    
+    char feedback[] = "br 1";
+    feedback[3] = '1' + brightness_level;
+    ShowMessage(feedback, MESSAGE_SHORT_MS);
+    
+    // If display is off, turn it on at the new brightness
+    if (!display_on) {
+        WakeDisplay();
+        ArmTimer(&display_timer, display_timeout_ms, 0, EVENT_DISPLAY_TIMEOUT);
+    }
+}
+
+/**
+ * Moves the clock by whole minutes, forwards for UP and backwards for DOWN, wrapping at midnight.
+ * Called with interrupts masked.
+ */
+void AdjustMinutes(uint8_t button, uint8_t amount) {
+    int32_t delta_s = (int32_t)amount * 60;
+    
+    time_of_day = AddToTimeOfDay(time_of_day, (button == BUTTON_UP) ? delta_s : -delta_s);
+    PostEvent(EVENT_SCHEDULE);
+}
+
+/**
+ * UP/DOWN press: enter time-setting mode and apply the immediate single-minute adjustment.
+ */
+void HandleTimeButtonPress(uint8_t button) {
+    // The tick ISR also updates the clock, so the changes are made with it masked
+    uint8_t interrupts = CyEnterCriticalSection();
+    uint8_t entering = !time_setting_mode;
+    
+    if (entering) {
+        time_setting_mode = 1;
+        time_of_day -= time_of_day % 60;
+        millis_in_second = 0;
+        dots_on = 1;
+    }
+    
+    if (button_pressed == 0) {
+        button_pressed = button;
+        CancelTimer(&time_setting_timer); // Restarted on release
+        AdjustMinutes(button, 1);
+        MarkTimeChanged();
+        MarkDisplayDirty(DIRTY_DIGITS | DIRTY_DOTS);
+    }
+    
+    CyExitCriticalSection(interrupts);
+    
+    if (entering) {
+        ShowMessage("SEt", MESSAGE_SHORT_MS);
+    } else {
+        ClearMessage();
+    }
+}
+
+/**
+ * UP/DOWN auto-repeat: step the time by the amount from the acceleration curve.
+ */
+void HandleTimeButtonRepeat(uint8_t button, uint8_t step) {
+    if (!time_setting_mode || button_pressed != button) {
+        return;
+    }
+    
+    uint8_t interrupts = CyEnterCriticalSection();
+    AdjustMinutes(button, step);
+    CyExitCriticalSection(interrupts);
+    
+    ClearMessage(); // Fast adjustments need the time on the display
+    MarkTimeChanged();
+    MarkDisplayDirty(DIRTY_DIGITS);
+}
+
+/**
+ * UP/DOWN release: the adjustment is finished, so the new time can be written straight away.
+ */
+void HandleTimeButtonRelease(uint8_t button) {
+    if (button_pressed != button) {
+        return;
     }
     
-    if (!initialized) {
+    button_pressed = 0;
+    ArmTimer(&time_setting_timer, TIME_SETTING_TIMEOUT_MS, 0, EVENT_SETTING_TIMEOUT);
+    FlushTimeToDS1307();
+}
+
+/**
+ * Drains the input queue and dispatches the events.
+ */
+void InputTask(void) {
+    uint8_t tail = input_queue_tail;
+    
+    while (tail != input_queue_head) {
+        InputEvent event = input_queue[tail & (INPUT_QUEUE_SIZE - 1)];
+        __DMB(); // Finish reading the entry before handing the slot back
+        input_queue_tail = ++tail;
+        input_queue_stats.consumed++;
+        
+        if (event.button == BUTTON_BRIGHTNESS) {
+            if (event.kind == INPUT_PRESS) {
+                HandleBrightnessPress();
+            }
+            continue;
+        }
+        
+        switch (event.kind) {
+            case INPUT_PRESS:
+                HandleTimeButtonPress(event.button);
+                break;
+            case INPUT_REPEAT:
+                HandleTimeButtonRepeat(event.button, event.step);
+                break;
+            case INPUT_RELEASE:
+                HandleTimeButtonRelease(event.button);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+/**
+ * Leaves time-setting mode once time_setting_timer fires, 5 seconds after the last release.
+ */
+void ButtonTask(void) {
+    if (TakeTimerFired(&time_setting_timer) && time_setting_mode && button_pressed == 0) {
+        time_setting_mode = 0;
+        dots_on = 1;
+        MarkDisplayDirty(DIRTY_DOTS);
+        
+        // Resync after the new time has been written, and restart the hourly interval from here
+        FlushTimeToDS1307();
         ReadTimeFromDS1307();
-        if (i2c_error) {
-            hours = 12;
-            minutes = 12;
-            seconds = 0;
-            i2c_error = 0;
+        ArmTimer(&rtc_resync_timer, RTC_RESYNC_INTERVAL_MS, RTC_RESYNC_INTERVAL_MS, EVENT_RTC);
+        PostEvent(EVENT_SCHEDULE); // The new time is final, so ScheduleTask handles the jump now
+    }
+}
+
+#if (SERIAL_PROTOCOL)
+/**
+ * ISR handler for UART_1 receive: moves the RX FIFO into serial_rx.
+ */
+CY_ISR(SerialRxInterruptHandler) {
+    while (UART_1_ReadRxStatus() & UART_1_RX_STS_FIFO_NOTEMPTY) {
+        uint8_t data = UART_1_ReadRxData();
+        uint8_t head = serial_rx_head;
+        
+        if ((uint8_t)(head - serial_rx_tail) >= SERIAL_RX_SIZE) {
+            serial_rx_overruns++;
+            continue;
         }
+        serial_rx[head & (SERIAL_RX_SIZE - 1)] = data;
+        __DMB(); // Publish the byte before the index
+        serial_rx_head = head + 1;
     }
-    UpdateDisplayTime();
+    PostEvent(EVENT_SERIAL);
+}
+
+/**
+ * CRC-8, polynomial 0x07, one byte at a time.
+ */
+uint8_t Crc8Update(uint8_t crc, uint8_t data) {
+    crc ^= data;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+        crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+    }
+    return crc;
+}
+
+/**
+ * Byte at the given offset from the start of the unparsed data.
+ */
+uint8_t SerialPeek(uint8_t offset) {
+    return serial_rx[(uint8_t)(serial_rx_tail + offset) & (SERIAL_RX_SIZE - 1)];
+}
+
+/**
+ * Stores a 32-bit value little-endian.
+ */
+void PutLittleEndian32(uint8_t *buffer, uint32_t value) {
+    buffer[0] = (uint8_t)value;
+    buffer[1] = (uint8_t)(value >> 8);
+    buffer[2] = (uint8_t)(value >> 16);
+    buffer[3] = (uint8_t)(value >> 24);
+}
+
+/**
+ * Frames and sends the payload already placed at serial_tx[SERIAL_HEADER].
+ */
+void SendSerialFrame(uint8_t command, uint8_t length) {
+    uint8_t crc = 0;
+    
+    serial_tx[0] = SERIAL_SYNC;
+    serial_tx[1] = command;
+    serial_tx[2] = length;
+    for (uint8_t i = 1; i < SERIAL_HEADER + length; i++) {
+        crc = Crc8Update(crc, serial_tx[i]);
+    }
+    serial_tx[SERIAL_HEADER + length] = crc;
+    UART_1_PutArray(serial_tx, SERIAL_HEADER + length + 1);
+}
+
+/**
+ * Sends the front frame's slot words. Called from UpdateDisplayTime after each publish.
+ */
+void SendDisplayFrame(void) {
+    uint8_t *payload = &serial_tx[SERIAL_HEADER];
+    uint8_t length = 0;
     
-    uint32_t last_button_check = 0;
-    uint32_t last_time_read = 0;
-    uint32_t last_fade_update = 0;
-    uint32_t last_pir_check = 0;
+    for (uint8_t slot = 0; slot < DISPLAY_SLOTS; slot++) {
+        for (uint8_t chip = 0; chip < DISPLAY_CHAIN_LENGTH; chip++) {
+            uint16_t word = frame_buffers[front_buffer][slot].words[chip];
+            payload[length++] = (uint8_t)word;
+            payload[length++] = (uint8_t)(word >> 8);
+        }
+    }
+    SendSerialFrame(SERIAL_FRAME, length);
+}
+
+/**
+ * Executes one verified frame. The payload is read straight from the receive ring.
+ */
+void HandleSerialCommand(uint8_t command, uint8_t length) {
+    uint8_t *reply = &serial_tx[SERIAL_HEADER];
+    uint8_t reply_length = 1;
+    reply[0] = SERIAL_OK;
     
-    for (;;) {
-        // Handle brightness fading
-        if (fading) {
-            uint32_t current_time = tick_count;
-            uint32_t elapsed_time = current_time - fade_start_time;
+    switch (command) {
+        case SERIAL_CMD_PING:
+            reply[1] = SERIAL_VERSION;
+            reply_length = 2;
+            break;
             
-            // Check if fade is complete
-            if (elapsed_time >= FADE_DURATION_MS) {
-                current_brightness = target_brightness;
-                PWM_2_WriteCompare(display_on ? current_brightness : 0);
-                fading = 0; // Stop fading
+        case SERIAL_CMD_SET_TIME: {
+            if (length != 3) {
+                reply[0] = SERIAL_BAD_LENGTH;
+                break;
             }
-            // Update brightness incrementally
-            else if (current_time - last_fade_update >= FADE_STEP_MS) {
-                // Calculate the progress (0 to 1) through the fade
-                float progress = (float)elapsed_time / FADE_DURATION_MS;
-                int16_t brightness_diff = target_brightness - start_brightness; // Difference from start to target
-                current_brightness = start_brightness + (int16_t)(brightness_diff * progress);
-                
-                // Ensure current_brightness stays within bounds
-                if (target_brightness > start_brightness) {
-                    if (current_brightness > target_brightness) current_brightness = target_brightness;
-                    if (current_brightness < start_brightness) current_brightness = start_brightness;
-                } else {
-                    if (current_brightness < target_brightness) current_brightness = target_brightness;
-                    if (current_brightness > start_brightness) current_brightness = start_brightness;
-                }
-                
-                PWM_2_WriteCompare(display_on ? current_brightness : 0);
-                last_fade_update = current_time;
+            uint8_t new_hours = SerialPeek(SERIAL_HEADER);
+            uint8_t new_minutes = SerialPeek(SERIAL_HEADER + 1);
+            uint8_t new_seconds = SerialPeek(SERIAL_HEADER + 2);
+            if (new_hours >= 24 || new_minutes >= 60 || new_seconds >= 60) {
+                reply[0] = SERIAL_BAD_VALUE;
+                break;
+            }
+            
+            uint8_t interrupts = CyEnterCriticalSection();
+            SetTimeOfDay(TIME_OF_DAY(new_hours, new_minutes, new_seconds));
+            millis_in_second = 0;
+            CyExitCriticalSection(interrupts);
+            
+            // One burst for all three registers. The clock is set either way; a write that could not be
+            // queued is retried by the flush, but the host is told the RTC does not have it yet.
+            if (!WriteTimeToDS1307()) {
+                reply[0] = SERIAL_BUSY;
             }
+            MarkDisplayDirty(DIRTY_DIGITS | DIRTY_DOTS);
+            PostEvent(EVENT_SCHEDULE);
+            break;
         }
         
-        // Check PIR sensor every 100ms
-        if (tick_count - last_pir_check >= 100) {
-            CheckPIRSensor();
-            last_pir_check = tick_count;
+        case SERIAL_CMD_SET_SCHEDULE: {
+            if (length != 1 + SCHEDULE_ENTRY_SIZE) {
+                reply[0] = SERIAL_BAD_LENGTH;
+                break;
+            }
+            uint8_t index = SerialPeek(SERIAL_HEADER);
+            uint8_t entry[SCHEDULE_ENTRY_SIZE];
+            for (uint8_t i = 0; i < SCHEDULE_ENTRY_SIZE; i++) {
+                entry[i] = SerialPeek(SERIAL_HEADER + 1 + i);
+            }
+            uint8_t used = (entry[0] & 0xF0) == SCHEDULE_TAG;
+            if (index >= SCHEDULE_ENTRIES ||
+                (used && ((entry[0] & 0x0F) > SCHEDULE_HOLD_DISPLAY || entry[1] >= 24 || entry[2] >= 60))) {
+                reply[0] = SERIAL_BAD_VALUE;
+                break;
+            }
+            if (!PostDS1307Request(1, NVRAM_SCHEDULE_ADDRESS + index * SCHEDULE_ENTRY_SIZE, entry,
+                                   SCHEDULE_ENTRY_SIZE, NULL)) {
+                reply[0] = SERIAL_BUSY;
+                break;
+            }
+            for (uint8_t i = 0; i < SCHEDULE_ENTRY_SIZE; i++) {
+                schedule[index][i] = used ? entry[i] : 0;
+            }
+            schedule_rescan = 1;
+            PostEvent(EVENT_SCHEDULE);
+            break;
         }
         
-        // Read time from DS1307 every 500ms to update display
-        if (tick_count - last_time_read >= 500) {
-            if (!time_setting_mode) {
-                ReadTimeFromDS1307();
-                if (!i2c_error) {
-                    UpdateDisplayTime();
+        case SERIAL_CMD_GET_SCHEDULE:
+            for (uint8_t i = 0; i < SCHEDULE_ENTRIES; i++) {
+                for (uint8_t j = 0; j < SCHEDULE_ENTRY_SIZE; j++) {
+                    reply[reply_length++] = schedule[i][j];
                 }
             }
-            last_time_read = tick_count;
-        }
+            break;
         
-        // Handle long press adjustments for time setting
-        if (time_setting_mode && button_pressed != 0) {
-            uint32_t current_time = tick_count;
-            uint32_t press_duration = current_time - button_press_start;
+        case SERIAL_CMD_SET_CONFIG: {
+            if (length != 5) {
+                reply[0] = SERIAL_BAD_LENGTH;
+                break;
+            }
+            uint8_t level = SerialPeek(SERIAL_HEADER);
+            uint8_t curve = SerialPeek(SERIAL_HEADER + 1);
+            uint16_t timeout_s = ((uint16_t)SerialPeek(SERIAL_HEADER + 3) << 8) | SerialPeek(SERIAL_HEADER + 4);
+            if (level >= BRIGHTNESS_LEVELS || curve > FADE_CURVE_EASE_IN_OUT || timeout_s == 0) {
+                reply[0] = SERIAL_BAD_VALUE;
+                break;
+            }
             
-            if (press_duration >= 2000) {
-                adjustment_speed = 2;
-            } else if (press_duration >= 500) {
-                adjustment_speed = 1;
-            } else {
-                adjustment_speed = 0;
+            fade_curve = curve;
+            fade_duration_ms = (uint16_t)SerialPeek(SERIAL_HEADER + 2) * 10;
+            display_timeout_ms = (uint32_t)timeout_s * 1000;
+            if (level != brightness_level) {
+                brightness_level = level;
+                StartFade(level);
             }
+            MarkSettingsChanged();
+            break;
+        }
+        
+        case SERIAL_CMD_TELEMETRY: {
+            Telemetry snapshot;
+            ReadTelemetry(&snapshot);
             
-            if (current_time - last_button_check >= 250) {
-                uint8_t adjustment_amount = 0;
-                if (adjustment_speed == 1) {
-                    adjustment_amount = 1;
-                } else if (adjustment_speed == 2) {
-                    adjustment_amount = 5;
-                }
-                
-                if (adjustment_amount > 0) {
-                    if (button_pressed == 1) {
-                        minutes += adjustment_amount;
-                        while (minutes >= 60) {
-                            minutes -= 60;
-                            hours++;
-                            if (hours >= 24) {
-                                hours = 0;
-                            }
-                        }
-                    } else if (button_pressed == 2) {
-                        while (adjustment_amount > 0) {
-                            if (minutes == 0) {
-                                minutes = 59;
-                                if (hours == 0) {
-                                    hours = 23;
-                                } else {
-                                    hours--;
-                                }
-                            } else {
-                                minutes--;
-                            }
-                            adjustment_amount--;
-                        }
-                    }
-                    WriteTimeToDS1307();
-                    if (!i2c_error) {
-                        UpdateDisplayTime();
-                    }
-                    last_button_activity = current_time;
-                }
-                last_button_check = current_time;
+            // The block is all 32-bit counters
+            const uint32_t *counters = (const uint32_t *)&snapshot;
+            for (uint8_t i = 0; i < sizeof(Telemetry) / sizeof(uint32_t); i++) {
+                PutLittleEndian32(&reply[reply_length], counters[i]);
+                reply_length += 4;
             }
+            break;
         }
         
-        // Check for timeout to exit time-setting mode (5 seconds of inactivity)
-        if (time_setting_mode && button_pressed == 0) {
-            if (tick_count - last_button_activity >= 5000) {
-                time_setting_mode = 0;
-                dots_on = 1;
+        case SERIAL_CMD_ISR_STATS: {
+#if (ISR_PROFILING)
+            IsrProfile profile;
+            if (length != 1) {
+                reply[0] = SERIAL_BAD_LENGTH;
+            } else if (!ReadIsrProfile(SerialPeek(SERIAL_HEADER), &profile)) {
+                reply[0] = SERIAL_BAD_VALUE;
+            } else {
+                uint32_t mean = (profile.count != 0) ? (uint32_t)(profile.total_cycles / profile.count) : 0;
+                PutLittleEndian32(&reply[1], profile.count);
+                PutLittleEndian32(&reply[5], profile.min_cycles);
+                PutLittleEndian32(&reply[9], profile.max_cycles);
+                PutLittleEndian32(&reply[13], mean);
+                reply_length = 17;
             }
+#else
+            reply[0] = SERIAL_UNSUPPORTED;
+#endif
+            break;
         }
         
-        // Check for button release
-        if (button_pressed != 0) {
-            if (button_pressed == 1 && Pin_Up_Read() == 1) {
-                button_pressed = 0;
-                adjustment_speed = 0;
-                last_button_activity = tick_count;
-            } else if (button_pressed == 2 && Pin_Down_Read() == 1) {
-                button_pressed = 0;
-                adjustment_speed = 0;
-                last_button_activity = tick_count;
+        case SERIAL_CMD_STREAM:
+            if (length != 1) {
+                reply[0] = SERIAL_BAD_LENGTH;
+                break;
             }
+            serial_streaming = SerialPeek(SERIAL_HEADER) ? 1 : 0;
+            break;
+            
+        default:
+            reply[0] = SERIAL_UNSUPPORTED;
+            break;
+    }
+    
+    SendSerialFrame(command | SERIAL_REPLY, reply_length);
+}
+
+/**
+ * Parses frames in place from the receive ring and executes them. A bad frame drops its sync
+ * byte, so the parser resynchronises on the next one.
+ */
+void SerialTask(void) {
+    for (;;) {
+        uint8_t available = serial_rx_head - serial_rx_tail;
+        
+        if (available == 0) {
+            return;
+        }
+        if (SerialPeek(0) != SERIAL_SYNC) {
+            serial_rx_tail++;
+            continue;
+        }
+        if (available < SERIAL_HEADER) {
+            return;
         }
+        
+        uint8_t length = SerialPeek(2);
+        if (length > SERIAL_MAX_PAYLOAD) {
+            serial_bad_frames++;
+            serial_rx_tail++;
+            continue;
+        }
+        if (available < SERIAL_HEADER + length + 1) {
+            return; // Wait for the rest of the frame
+        }
+        
+        uint8_t crc = 0;
+        for (uint8_t i = 1; i < SERIAL_HEADER + length; i++) {
+            crc = Crc8Update(crc, SerialPeek(i));
+        }
+        if (crc != SerialPeek(SERIAL_HEADER + length)) {
+            serial_bad_frames++;
+            serial_rx_tail++;
+            continue;
+        }
+        
+        HandleSerialCommand(SerialPeek(1), length);
+        __DMB(); // Finish reading the frame before handing the bytes back
+        serial_rx_tail += SERIAL_HEADER + length + 1;
     }
 }
+#endif
+
+/**
+ * Main function.
+ */
+int main(void) {
+    CyGlobalIntEnable;
+    
+    // Cycle counter for the scheduler statistics, ISR profiling and boot timing
+    StartCycleCounter();
+    
+    SPIM_1_Start();
+    PWM_1_Start();
+    PWM_2_Start();
+    Timer_1_Start();
+    Timer_3_Start();
+    I2C_1_Start();
+    
+#if (DISPLAY_REFRESH_DMA)
+    InitializeDisplayDMA();
+#else
+    isr_1_StartEx(MultplexInterruptHandler);
+#endif
+    isr_6_StartEx(TickInterruptHandler);
+#if (PIR_INTERRUPT)
+    isr_PIR_StartEx(PIRInterruptHandler);
+#endif
+#if (SERIAL_PROTOCOL)
+    UART_1_Start();
+    isr_UART_StartEx(SerialRxInterruptHandler);
+#endif
+    
+    // Keep the display dark until the boot burst has restored the time and brightness
+    BlankDisplay();
+    
+    // No settling delay: the DS1307 runs from its battery and the engine does not block
+    i2c_error = 0;
+    InitializeDS1307();
+    
+    RegisterTask(FadeTask, 0, EVENT_FADE_STEP);
+    RegisterTask(CheckPIRSensor, 100, EVENT_DISPLAY_TIMEOUT);
+    RegisterTask(OccupancyTask, 1000, 0);
+    RegisterTask(DisplayTask, 0, EVENT_DISPLAY_DIRTY | EVENT_MESSAGE);
+    RegisterTask(InputTask, 0, EVENT_INPUT);
+    RegisterTask(ButtonTask, 0, EVENT_SETTING_TIMEOUT);
+    RegisterTask(RtcTask, 0, EVENT_RTC);
+    RegisterTask(ScheduleTask, 0, EVENT_SCHEDULE);
+#if (SERIAL_PROTOCOL)
+    RegisterTask(SerialTask, 0, EVENT_SERIAL);
+#endif
+    ArmTimer(&rtc_resync_timer, RTC_RESYNC_INTERVAL_MS, RTC_RESYNC_INTERVAL_MS, EVENT_RTC);
+    
+    RunScheduler();
+}